@@ -1,17 +1,51 @@
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <ostream>
-#include <regex>
+#include <queue>
+#include <random>
+#include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// On x86-64 the AVX2 relocation kernel and the SSE4.2 symbol hash are
+// compiled in with target attributes and picked at run time by CPU.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LINKER_CPU_DISPATCH 1
+#include <immintrin.h>
+#endif
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+
 using namespace std;
 
 static const int kMaxDefinitionListSize = 16;
@@ -23,6 +57,10 @@ static const int kInvalidInstructionCodeUnderflow = 0;
 static const int kMemorySize = 512;
 static const int kMaxOperand = 1000;
 static const int kMaxOpCode = 10;
+static const int kMaxSymbolLength = 16;
+static const size_t kInitialArenaSize = 64 << 10;
+static const size_t kMaxArenaSize = 64 << 20;
+static const size_t kInflateChunkSize = 64 << 10;
 
 enum SyntaxError {
     ERROR_OK = -1,
@@ -37,13 +75,346 @@ enum SyntaxError {
 
 namespace base {
 
+// CPU features the kernels are picked by, read once at startup.
+struct CpuFeatures {
+    bool sse42 = false;
+    bool avx2 = false;
+
+    CpuFeatures() {
+#if defined(LINKER_CPU_DISPATCH)
+        // Static constructors may run before the one of libgcc.
+        __builtin_cpu_init();
+        sse42 = __builtin_cpu_supports("sse4.2");
+        avx2 = __builtin_cpu_supports("avx2");
+#endif
+    }
+};
+
+static const CpuFeatures kCpu;
+
+// Monotonic arena holding all the state of a single link (symbol table,
+// use lists, symbol names and diagnostics). Allocation bumps a pointer and
+// nothing is freed until Reset() releases the whole link at once. The
+// initial block grows to the peak usage seen so far, so an arena reused for
+// the next link serves it without going back to the heap.
+class LinkArena {
+public:
+    explicit LinkArena(size_t initial_size = kInitialArenaSize)
+        : block_(initial_size), counter_(this) { Reset(); }
+
+    LinkArena(const LinkArena&) = delete;
+    LinkArena& operator=(const LinkArena&) = delete;
+
+    // Allocator for containers of the link. Stays valid across Reset().
+    std::pmr::memory_resource* resource() { return &counter_; }
+
+    // Releases everything allocated since the last reset. Containers using
+    // the arena must be destroyed before calling this.
+    void Reset();
+
+    // Bytes handed out since the last reset.
+    size_t used() const { return used_; }
+    // Largest used() seen over the lifetime of the arena.
+    size_t peak() const { return peak_; }
+
+private:
+    // Forwards to the monotonic resource and keeps track of usage.
+    class CountingResource : public std::pmr::memory_resource {
+    public:
+        explicit CountingResource(LinkArena* arena) : arena_(arena) {}
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            arena_->used_ += bytes;
+            arena_->peak_ = std::max(arena_->peak_, arena_->used_);
+            return arena_->monotonic_->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {}
+        bool do_is_equal(
+                const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+        LinkArena* arena_;
+    };
+
+    std::vector<char> block_;  // First block handed out by the arena.
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> monotonic_;
+    CountingResource counter_;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+};
+
+void LinkArena::Reset() {
+    // Grow the first block if the last link spilled out of it.
+    if (used_ > block_.size() && used_ <= kMaxArenaSize) {
+        monotonic_.reset();
+        block_ = std::vector<char>(used_ + used_ / 4);
+    }
+    monotonic_ = make_unique<std::pmr::monotonic_buffer_resource>(
+        block_.data(), block_.size());
+    used_ = 0;
+}
+
+// Input stream over text owned by someone else. Unlike istringstream it
+// doesn't copy the text, so an in memory input can be read by both passes.
+class MemoryIstream : public std::istream {
+public:
+    explicit MemoryIstream(std::string_view text)
+        : std::istream(nullptr), buf_(text) { rdbuf(&buf_); }
+
+private:
+    class MemoryStreamBuf : public std::streambuf {
+    public:
+        explicit MemoryStreamBuf(std::string_view text) {
+            char* begin = const_cast<char*>(text.data());
+            setg(begin, begin, begin + text.length());
+        }
+    };
+    MemoryStreamBuf buf_;
+};
+
+// Inflate counters, reported by --bench.
+struct InflateStats {
+    size_t compressed_bytes = 0;
+    size_t inflated_bytes = 0;
+    std::chrono::nanoseconds inflate_time{0};
+};
+
+// Copy of the inflated text of a compressed input.
+struct InflatedText {
+    std::string text;
+    bool complete = false;  // True once text holds the whole input.
+};
+
+// Input stream inflating gzip data read from "source" as it is consumed.
+// Decompressed data goes straight into the get area the reader (e.g.
+// getline in the tokenizer) consumes from. Every inflated byte is also
+// appended to "keep" if set. Corrupt or truncated data throws runtime_error
+// out of the reading call.
+class GzipIstream : public std::istream {
+public:
+    GzipIstream(std::unique_ptr<std::istream> source, InflatedText* keep,
+                InflateStats* stats)
+        : std::istream(nullptr), buf_(std::move(source), keep, stats) {
+        rdbuf(&buf_);
+        // Let the runtime_error of a corrupt input reach the caller.
+        exceptions(ios::badbit);
+    }
+
+private:
+    class GzipStreamBuf : public std::streambuf {
+    public:
+        GzipStreamBuf(std::unique_ptr<std::istream> source, InflatedText* keep,
+                      InflateStats* stats);
+        ~GzipStreamBuf() { inflateEnd(&zstream_); }
+    protected:
+        int_type underflow() override;
+    private:
+        std::unique_ptr<std::istream> source_;
+        InflatedText* keep_;  // Not owned, may be null.
+        InflateStats* stats_;  // Not owned, may be null.
+        z_stream zstream_;
+        // True when the last member was read up to its trailer.
+        bool member_ended_ = false;
+        std::vector<char> in_;
+        std::vector<char> out_;
+    };
+    GzipStreamBuf buf_;
+};
+
+GzipIstream::GzipStreamBuf::GzipStreamBuf(
+        std::unique_ptr<std::istream> source, InflatedText* keep,
+        InflateStats* stats)
+    : source_(std::move(source)), keep_(keep), stats_(stats),
+      in_(kInflateChunkSize), out_(kInflateChunkSize) {
+    memset(&zstream_, 0, sizeof(zstream_));
+    // 16 + MAX_WBITS: Expect a gzip header and trailer.
+    if (inflateInit2(&zstream_, 16 + MAX_WBITS) != Z_OK) {
+        throw runtime_error("Error: can't initialize zlib");
+    }
+}
+
+GzipIstream::int_type GzipIstream::GzipStreamBuf::underflow() {
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    while (true) {
+        if (zstream_.avail_in == 0) {
+            source_->read(in_.data(), in_.size());
+            zstream_.next_in = reinterpret_cast<Bytef*>(in_.data());
+            zstream_.avail_in = source_->gcount();
+            if (stats_)
+                stats_->compressed_bytes += zstream_.avail_in;
+            if (zstream_.avail_in == 0) {
+                // The source ended within a member (e.g. a cut trailer).
+                if (!member_ended_)
+                    throw runtime_error("Error: truncated compressed input");
+                if (keep_)
+                    keep_->complete = true;
+                return traits_type::eof();
+            }
+        }
+        zstream_.next_out = reinterpret_cast<Bytef*>(out_.data());
+        zstream_.avail_out = out_.size();
+        auto start = std::chrono::steady_clock::now();
+        int ret = inflate(&zstream_, Z_NO_FLUSH);
+        if (stats_)
+            stats_->inflate_time += std::chrono::steady_clock::now() - start;
+        if (ret == Z_STREAM_END) {
+            // gzip files may hold several members back to back.
+            inflateReset(&zstream_);
+            member_ended_ = true;
+        } else if (ret == Z_OK) {
+            member_ended_ = false;
+        } else if (ret != Z_BUF_ERROR) {
+            throw runtime_error("Error: corrupt compressed input");
+        }
+        size_t produced = out_.size() - zstream_.avail_out;
+        if (produced > 0) {
+            if (keep_)
+                keep_->text.append(out_.data(), produced);
+            if (stats_)
+                stats_->inflated_bytes += produced;
+            setg(out_.data(), out_.data(), out_.data() + produced);
+            return traits_type::to_int_type(*gptr());
+        }
+    }
+}
+
+// Object file on disk, plain text or gzip compressed. Compressed input is
+// inflated while it is read the first time and the text is kept, so
+// reading it again (pass 2) doesn't inflate twice and nothing is written
+// to a temporary file.
+class InputFile {
+public:
+    explicit InputFile(const std::string& filename,
+                       InflateStats* stats = nullptr)
+        : filename_(filename), stats_(stats) {}
+
+    // Opens the file from the beginning. The stream is in a failed state
+    // if the file can't be opened.
+    std::unique_ptr<std::istream> Open();
+
+private:
+    const std::string filename_;
+    InflateStats* stats_;  // Not owned, may be null.
+    InflatedText inflated_;  // Text of a compressed file.
+};
+
+std::unique_ptr<std::istream> InputFile::Open() {
+    if (inflated_.complete)
+        return make_unique<MemoryIstream>(inflated_.text);
+
+    auto stream = make_unique<ifstream>(filename_, ios::binary);
+    if (!stream->is_open())
+        return stream;
+    char magic[2] = {0, 0};
+    stream->read(magic, sizeof(magic));
+    stream->clear();
+    stream->seekg(0);
+    if (static_cast<unsigned char>(magic[0]) != 0x1f ||
+        static_cast<unsigned char>(magic[1]) != 0x8b) {
+        return stream;
+    }
+    // Not read to the end before, start over.
+    inflated_.text.clear();
+    return make_unique<GzipIstream>(std::move(stream), &inflated_, stats_);
+}
+
+// Reads "in" to the end. Unlike inserting its rdbuf() into a stream, this
+// lets the runtime_error of a corrupt compressed input reach the caller.
+std::string ReadStream(std::istream& in) {
+    std::string content;
+    std::vector<char> buffer(kInflateChunkSize);
+    while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+        content.append(buffer.data(), in.gcount());
+    }
+    return content;
+}
+
+// Returns the whole content of a file, inflated if it is compressed.
+// Empty if it can't be read. Throws runtime_error if the compressed data
+// is corrupt or truncated.
+std::string ReadFile(const std::string& filename) {
+    InputFile input(filename);
+    return ReadStream(*input.Open());
+}
+
+// Symbol name packed into 16 zero padded bytes. Symbols are at most
+// kMaxSymbolLength characters, so every valid symbol fits. Copying,
+// comparing and hashing work on the two 64 bit halves and never allocate.
+class alignas(16) SymbolKey {
+public:
+    SymbolKey() { memset(bytes_, 0, sizeof(bytes_)); }
+
+    // "name" must not be longer than kMaxSymbolLength.
+    explicit SymbolKey(std::string_view name) {
+        memset(bytes_, 0, sizeof(bytes_));
+        memcpy(bytes_, name.data(), name.length());
+    }
+
+    // Name of the symbol. Points into the key.
+    std::string_view str() const {
+        return std::string_view(bytes_, strnlen(bytes_, sizeof(bytes_)));
+    }
+
+    bool operator==(const SymbolKey& other) const {
+#if defined(__SSE2__)
+        __m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes_));
+        __m128i b = _mm_load_si128(
+            reinterpret_cast<const __m128i*>(other.bytes_));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF;
+#else
+        return low() == other.low() && high() == other.high();
+#endif
+    }
+    bool operator!=(const SymbolKey& other) const { return !(*this == other); }
+
+    // Same order as comparing the names as strings, as the padding is zero.
+    bool operator<(const SymbolKey& other) const {
+        return memcmp(bytes_, other.bytes_, sizeof(bytes_)) < 0;
+    }
+
+    size_t Hash() const {
+#if defined(LINKER_CPU_DISPATCH)
+        if (kCpu.sse42)
+            return Crc32Hash(low(), high());
+#endif
+        uint64_t h = (low() ^ (high() * 0x9E3779B97F4A7C15ULL)) *
+            0xBF58476D1CE4E5B9ULL;
+        return h ^ (h >> 31);
+    }
+
+private:
+#if defined(LINKER_CPU_DISPATCH)
+    // Only called when the CPU has SSE4.2.
+    __attribute__((target("sse4.2")))
+    static size_t Crc32Hash(uint64_t low, uint64_t high) {
+        return _mm_crc32_u64(_mm_crc32_u64(0, low), high);
+    }
+#endif
+
+    uint64_t low() const { uint64_t w; memcpy(&w, bytes_, 8); return w; }
+    uint64_t high() const { uint64_t w; memcpy(&w, bytes_ + 8, 8); return w; }
+
+    char bytes_[kMaxSymbolLength];
+};
+
+struct SymbolKeyHash {
+    size_t operator()(const SymbolKey& key) const { return key.Hash(); }
+};
+
+ostream& operator<<(ostream& os, const SymbolKey& key) {
+    return os << key.str();
+}
+
 // Data class for storing individual tokens in the compiled object file.
+// The token text points into the line buffer of the tokenizer and is only
+// valid while that line is being processed.
 class Token {
 
 public:
-    Token(int line_num, int position, const std::string& token) 
+    Token(int line_num, int position, std::string_view token) 
         : line_num_(line_num), position_(position), 
-        token_(token), err_(std::make_unique<SyntaxError>()) { *err_ = ERROR_OK; }
+        token_(token), err_(ERROR_OK) {}
 
     // Location of line the token points to.
     int line_num() const { return line_num_; }
@@ -52,23 +423,23 @@ public:
     int position() const { return position_; }
 
     // String representing the token.
-    const std::string& token() const { return token_; }
+    std::string_view token() const { return token_; }
 
     bool ReadAsInt(int* int_token) const;
 
-    bool ReadAsSymbol(std::string* str_token) const ;
+    bool ReadAsSymbol(SymbolKey* symbol_token) const ;
 
     bool ReadAsIAER(char* char_token) const;
 
-    void err(SyntaxError e) const { *err_ = e; }
+    void err(SyntaxError e) const { err_ = e; }
 
-    SyntaxError err() const {return *err_; }
+    SyntaxError err() const {return err_; }
 
 private:
     int line_num_;
     int position_;
-    std::string token_;
-    std::unique_ptr<SyntaxError> err_;  // Last error when trying to parse this token.
+    std::string_view token_;
+    mutable SyntaxError err_;  // Last error when trying to parse this token.
 
     friend std::ostream& operator<<(std::ostream& os, const Token& dt);
 };
@@ -104,6 +475,14 @@ string ErrorMessageForToken(const Token& token) {
     return buffer.str();
 }
 
+// Writes an error message on a line of its own. Parse error messages
+// already end with a new line, other errors don't.
+void PrintError(std::ostream& out, const std::string& message) {
+    out << message;
+    if (message.empty() || message.back() != '\n')
+        out << endl;
+}
+
 ostream& operator<<(ostream& os, const Token& t) {
     os  << "Token: " << t.line_num() << ":" << t.position() << " : "
         << t.token();
@@ -111,37 +490,47 @@ ostream& operator<<(ostream& os, const Token& t) {
 }
 
 bool Token::ReadAsInt(int* int_token) const {
-    if (!TryParseInt(token(), int_token)) {
-        *err_ = ERROR_NUM_EXPECTED;
+    // Numbers fit the small string buffer, this doesn't allocate.
+    if (!TryParseInt(std::string(token_), int_token)) {
+        err_ = ERROR_NUM_EXPECTED;
         return false;
     }
     return true;
 }
 
-bool Token::ReadAsSymbol(std::string* str_token) const {
+static bool IsAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool IsAlphaNumeric(char c) {
+    return IsAlpha(c) || (c >= '0' && c <= '9');
+}
+
+bool Token::ReadAsSymbol(SymbolKey* symbol_token) const {
     // Accepted symbols should be upto 16 characters long
     // (not including terminations e.g. ‘\0’), 
-    if (token_.length() > 16) {
-        *err_ = ERROR_SYM_TOO_LONG;
+    if (token_.length() > kMaxSymbolLength) {
+        err_ = ERROR_SYM_TOO_LONG;
         return false;
     }
     // Symbol must follow [a-Z][a-Z0-9]*
-    if (!std::regex_match(token_, std::regex("[a-zA-Z][a-zA-Z0-9]*"))) {
-        *err_ = ERROR_SYM_EXPECTED;
+    if (token_.empty() || !IsAlpha(token_[0]) ||
+        !std::all_of(token_.begin() + 1, token_.end(), IsAlphaNumeric)) {
+        err_ = ERROR_SYM_EXPECTED;
         return false;
     }
-    *str_token = token();
+    *symbol_token = SymbolKey(token_);
     return true;
 }
 
 bool Token::ReadAsIAER(char* char_token) const {
     if (token_.length() != 1) {
-        *err_ = ERROR_ADDR_EXPECTED;
+        err_ = ERROR_ADDR_EXPECTED;
         return false;
     }
     char c = token_[0];
     if (c != 'I' && c != 'A' && c != 'E' && c != 'R') {
-        *err_ = ERROR_ADDR_EXPECTED;
+        err_ = ERROR_ADDR_EXPECTED;
         return false;        
     }
     *char_token = c;
@@ -161,142 +550,313 @@ public:
 
     int module() const { return module_; }
 
-    std::string err() const { return err_; }
-    void err(const std::string& e) { err_ = e; }
+    // Diagnostics are string literals, storing them doesn't allocate.
+    std::string_view err() const { return err_; }
+    void err(std::string_view e) { err_ = e; }
 
     int value() const { return value_; }
     void value(int v) { value_ = v; }
-    bool used() { return used_; }
-    void used(bool u) { used_ = u; }
-    int sorting_index() { return sorting_index_; }
+    // Atomic so that instructions may be relocated by several threads.
+    bool used() const { return used_.load(std::memory_order_relaxed); }
+    void used(bool u) { used_.store(u, std::memory_order_relaxed); }
+    int sorting_index() const { return sorting_index_; }
 private:
-    std::string err_;  // Any error/warning related to symbol.
+    std::string_view err_;  // Any error/warning related to symbol.
     int value_;  // Symbol value.
     const int module_;  // Module where symbol is defined.
-    bool used_;  // True if the symbol is used.
+    std::atomic<bool> used_;  // True if the symbol is used.
     const int sorting_index_;  // Index of symbol definition.
 };
 
 
+// Module number in messages. See SymbolTable::Module.
+struct ModuleRef {
+    int module;
+    const std::string* source;  // May be null.
+};
+
+ostream& operator<<(ostream& os, const ModuleRef& ref) {
+    os << "Module " << ref.module;
+    if (ref.source != nullptr)
+        os << " (" << *ref.source << ")";
+    return os;
+}
+
 // Symbol table data struction to hold symbols between pass1 & pass2.
 class SymbolTable {
 public:
+    // All the symbols and names are allocated from "arena" which must
+    // outlive the table.
+    explicit SymbolTable(std::pmr::memory_resource* arena)
+        : symbol_value_(arena), arena_(arena) {}
+
+    // Arena backing this link. Also used for the other per link state.
+    std::pmr::memory_resource* arena() const { return arena_; }
+
+    // Source file of every module (index is module number - 1) when the
+    // modules of the link come from several files. Not owned, may be null.
+    void module_sources(const std::vector<std::string>* sources) {
+        module_sources_ = sources;
+    }
+    // Module reference for messages, "Module <n>" followed by the source
+    // file of the module when known.
+    ModuleRef Module(int module) const;
+
     // Add symbol to symbol table. Only called from pass 1.
-    void AddSymbol(const std::string& symbol, int value, int module);
+    void AddSymbol(const base::SymbolKey& symbol, int value, int module);
     // Check bounds on symbol value. Handles Rule 5.
+    // Warnings are only printed if "warn" is set.
     void VerifySymbol(
-        int last_module, int last_module_size, int curr_module_index) const;
-    // Prints symbol table to console.
-    void Print() const;
+        int last_module, int last_module_size, int curr_module_index,
+        std::ostream& out, bool warn) const;
+    // Prints symbol table to the output of the link.
+    void Print(std::ostream& out) const;
     // Returns the value of symbol. Also mark it used if mark_use set.
-    int Value(const std::string& symbol, bool mark_use) const;
+    int Value(const base::SymbolKey& symbol, bool mark_use) const;
     // Check is a symbol from symbol table is used. (end of pass 2).
-    void VerifySymbolUsed() const;
+    void VerifySymbolUsed(std::ostream& out) const;
+    // Calls "visit" with the symbol, value and module of every symbol in
+    // definition order (the order of Print).
+    void ForEachSymbol(const std::function<void(
+        const base::SymbolKey&, int, int)>& visit) const;
+
+    typedef std::pmr::unordered_map<
+        base::SymbolKey, SymbolData, base::SymbolKeyHash> SymbolMap;
 private:
-    // Holds symbols.
-    std::map<std::string, std::unique_ptr<SymbolData>> symbol_value_;
+    // Holds symbols. Mutable as pass 2 marks symbols used and Rule 5
+    // fixes values through the read only table.
+    mutable SymbolMap symbol_value_;
+    std::pmr::memory_resource* arena_;
+    const std::vector<std::string>* module_sources_ = nullptr;
+
+    // Symbols in definition order.
+    std::pmr::vector<const SymbolMap::value_type*> OrderedSymbols() const;
 };
 
-bool PairComparer(const pair<string, int>& a,  const pair<string, int>& b) { 
-    return a.second < b.second; 
+ModuleRef SymbolTable::Module(int module) const {
+    ModuleRef ref{module, nullptr};
+    if (module_sources_ != nullptr && module >= 1 &&
+        module <= static_cast<int>(module_sources_->size())) {
+        ref.source = &(*module_sources_)[module - 1];
+    }
+    return ref;
+}
+
+bool SortingIndexComparer(const SymbolTable::SymbolMap::value_type* a,
+                          const SymbolTable::SymbolMap::value_type* b) { 
+    return a->second.sorting_index() < b->second.sorting_index(); 
+}
+
+// Warnings are reported in the order of symbol names.
+bool SymbolNameComparer(const SymbolTable::SymbolMap::value_type* a,
+                        const SymbolTable::SymbolMap::value_type* b) { 
+    return a->first < b->first; 
 }
 
-void SymbolTable::AddSymbol(const string& symbol, int value, int module) {
-    if (symbol_value_.find(symbol) != symbol_value_.end()) {
-        symbol_value_[symbol]->err(
+void SymbolTable::AddSymbol(
+        const base::SymbolKey& symbol, int value, int module) {
+    auto it = symbol_value_.find(symbol);
+    if (it != symbol_value_.end()) {
+        it->second.err(
             "Error: This variable is multiple times defined; first value used");
         return;
     }
-    symbol_value_.insert(std::make_pair(
-        symbol, make_unique<SymbolData>(module, symbol_value_.size())));
-    symbol_value_[symbol]->value(value);
+    it = symbol_value_.emplace(
+        std::piecewise_construct, std::forward_as_tuple(symbol),
+        std::forward_as_tuple(module, symbol_value_.size())).first;
+    it->second.value(value);
 }
 
 void SymbolTable::VerifySymbol(
-    int last_module, int last_module_size, int curr_module_index) const {
+    int last_module, int last_module_size, int curr_module_index,
+    std::ostream& out, bool warn) const {
     int last_module_index = curr_module_index - last_module_size;
-    for (const auto& kv : symbol_value_) {
-        if (kv.second->module() != last_module)
+    std::pmr::vector<SymbolMap::value_type*> too_big(arena_);
+    for (auto& kv : symbol_value_) {
+        if (kv.second.module() != last_module)
             continue;
-        int relative_value = kv.second->value() - last_module_index;
+        int relative_value = kv.second.value() - last_module_index;
         if (relative_value >= last_module_size) {
-            cout << "Warning: Module " << last_module <<": "
-                << kv.first << " too big " << relative_value << " (max="
-                << last_module_size - 1 << ") assume zero relative" << endl;
-            kv.second->value(last_module_index);
+            too_big.push_back(&kv);
+        }
+    }
+    sort(too_big.begin(), too_big.end(), SymbolNameComparer);
+    for (auto* symbol : too_big) {
+        if (warn) {
+            int relative_value = symbol->second.value() - last_module_index;
+            out << "Warning: " << Module(last_module) << ": "
+                << symbol->first << " too big " << relative_value << " (max="
+                << last_module_size - 1 << ") assume zero relative"
+                << endl;
         }
+        symbol->second.value(last_module_index);
     }
 }
 
-void SymbolTable::VerifySymbolUsed() const {
+void SymbolTable::VerifySymbolUsed(std::ostream& out) const {
+    std::pmr::vector<const SymbolMap::value_type*> unused(arena_);
     for (const auto& kv : symbol_value_) {
-        if (!kv.second->used()) {
-            cout << "Warning: Module " << kv.second->module() << ": "
-                << kv.first << " was defined but never used"
-                << endl;
+        if (!kv.second.used()) {
+            unused.push_back(&kv);
         }
     }
+    sort(unused.begin(), unused.end(), SymbolNameComparer);
+    for (const auto* symbol : unused) {
+        out << "Warning: " << Module(symbol->second.module()) << ": "
+            << symbol->first << " was defined but never used"
+            << endl;
+    }
 }
 
-void SymbolTable::Print() const {
-    vector<pair<string, int>> ordered_symbols;
+std::pmr::vector<const SymbolTable::SymbolMap::value_type*>
+SymbolTable::OrderedSymbols() const {
+    std::pmr::vector<const SymbolMap::value_type*> ordered_symbols(arena_);
+    ordered_symbols.reserve(symbol_value_.size());
     for (const auto& kv : symbol_value_) {
-        ordered_symbols.push_back(
-            make_pair(kv.first, kv.second->sorting_index()));
+        ordered_symbols.push_back(&kv);
+    }
+    sort(ordered_symbols.begin(), ordered_symbols.end(), SortingIndexComparer);
+    return ordered_symbols;
+}
+
+void SymbolTable::ForEachSymbol(const std::function<void(
+        const base::SymbolKey&, int, int)>& visit) const {
+    for (const auto* symbol : OrderedSymbols()) {
+        visit(symbol->first, symbol->second.value(), symbol->second.module());
     }
-    sort(ordered_symbols.begin(), ordered_symbols.end(), PairComparer);
-    cout << "Symbol Table" << endl;
+}
+
+void SymbolTable::Print(std::ostream& out) const {
+    out << "Symbol Table" << endl;
 
-    for (const auto& symbol : ordered_symbols) {
-        const auto& symbol_data = symbol_value_.at(symbol.first);
-        cout << symbol.first << "=" << symbol_data->value();
-        if (!symbol_data->err().empty()) {
-            cout << " " << symbol_data->err();
+    for (const auto* symbol : OrderedSymbols()) {
+        const auto& symbol_data = symbol->second;
+        out << symbol->first << "=" << symbol_data.value();
+        if (!symbol_data.err().empty()) {
+            out << " " << symbol_data.err();
         }
-        cout << endl;
+        out << endl;
     }
-    cout << endl;
+    out << endl;
 }
 
-int SymbolTable::Value(const std::string& symbol, bool mark_use) const {
-    if (symbol_value_.find(symbol) == symbol_value_.end()) {
+int SymbolTable::Value(const base::SymbolKey& symbol, bool mark_use) const {
+    auto it = symbol_value_.find(symbol);
+    if (it == symbol_value_.end()) {
         return -1;
     }
     if (mark_use) {
-        symbol_value_.at(symbol)->used(true);
+        it->second.used(true);
+    }
+    return it->second.value();
+}
+
+// Symbol definitions added by several threads at once, e.g. while object
+// files are loaded in parallel. The first definition of a symbol in
+// (module, def list position) order wins whatever the order of the calls,
+// so freezing the table gives the serial SymbolTable.
+class ConcurrentSymbolTable {
+public:
+    // Adds the "position"-th definition of the def list of "module".
+    // "value" is absolute. Thread safe.
+    void AddSymbol(const base::SymbolKey& symbol, int value, int module,
+                   int position);
+    // Fills the empty "table" as pass 1 would have with the same
+    // definitions, before rule 5 is checked. Not thread safe with AddSymbol.
+    void Freeze(SymbolTable* table) const;
+private:
+    // Place of a definition in the input.
+    struct Definition {
+        int module;
+        int position;
+        int value;
+        bool operator<(const Definition& other) const {
+            return module != other.module ? module < other.module
+                                          : position < other.position;
+        }
+    };
+    // First definition of a symbol and whether there are others.
+    struct Entry {
+        Definition first;
+        bool multiple = false;
+    };
+    // Symbols are spread over shards by hash to keep lock contention low.
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<base::SymbolKey, Entry, base::SymbolKeyHash>
+            symbols;
+    };
+    static const int kShardCount = 16;
+    Shard shards_[kShardCount];
+};
+
+void ConcurrentSymbolTable::AddSymbol(
+        const base::SymbolKey& symbol, int value, int module, int position) {
+    Definition definition{module, position, value};
+    Shard& shard = shards_[symbol.Hash() % kShardCount];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto inserted = shard.symbols.emplace(symbol, Entry{definition});
+    if (inserted.second)
+        return;
+    Entry& entry = inserted.first->second;
+    entry.multiple = true;
+    if (definition < entry.first)
+        entry.first = definition;
+}
+
+void ConcurrentSymbolTable::Freeze(SymbolTable* table) const {
+    std::vector<const std::pair<const base::SymbolKey, Entry>*> ordered;
+    for (const auto& shard : shards_) {
+        for (const auto& kv : shard.symbols)
+            ordered.push_back(&kv);
+    }
+    sort(ordered.begin(), ordered.end(), [](const auto* a, const auto* b) {
+        return a->second.first < b->second.first;
+    });
+    // Replaying the first definitions in input order gives the insertion
+    // order of pass 1. A second AddSymbol flags the multiple definition.
+    for (const auto* symbol : ordered) {
+        const Definition& first = symbol->second.first;
+        table->AddSymbol(symbol->first, first.value, first.module);
+        if (symbol->second.multiple)
+            table->AddSymbol(symbol->first, first.value, first.module);
     }
-    return symbol_value_.at(symbol)->value();
 }
 
 // Holds data related to use of a symbol is use list. This is used to detect
 // is a symbol is not used.
 class UseData {
 public:
-    explicit UseData(const std::string& symbol) 
+    explicit UseData(const base::SymbolKey& symbol) 
         : symbol_(symbol), used_(false) {}
     bool used() const { return used_; }
     void used(bool u) {used_ = u; }
-    std::string symbol() const { return symbol_; }
+    const base::SymbolKey& symbol() const { return symbol_; }
 private:
-    std::string symbol_;
+    base::SymbolKey symbol_;
     bool used_;
 };
 
 // Data structure to hold use list in a module. Resets at module change,
 class UseList {
 public:
-    void AddSymbol(const std::string& symbol, int index);
+    explicit UseList(std::pmr::memory_resource* arena)
+        : use_list_(arena), arena_(arena) {}
+    void AddSymbol(const base::SymbolKey& symbol, int index);
     void Reset();
     bool Has(int index) const;
-    std::vector<std::string> UnusedSymbols() const;
-    const std::unique_ptr<UseData>& Get(int index);
+    // Entries are indexed from 0 to size() - 1.
+    int size() const { return use_list_.size(); }
+    std::pmr::vector<base::SymbolKey> UnusedSymbols() const;
+    UseData& Get(int index);
 private:
-    std::map<int, std::unique_ptr<UseData>> use_list_;
+    std::pmr::map<int, UseData> use_list_;
+    std::pmr::memory_resource* arena_;
 };
 
 
-void UseList::AddSymbol(const string& symbol, int index) {
-    use_list_.insert(make_pair(index, make_unique<UseData>(symbol)));
+void UseList::AddSymbol(const base::SymbolKey& symbol, int index) {
+    use_list_.emplace(index, UseData(symbol));
 }
 
 void UseList::Reset() {
@@ -307,17 +867,17 @@ bool UseList::Has(int index) const {
     return (use_list_.find(index) != use_list_.end());
 }
 
-vector<string> UseList::UnusedSymbols() const {
-    vector<string> unused_symbols;
+std::pmr::vector<base::SymbolKey> UseList::UnusedSymbols() const {
+    std::pmr::vector<base::SymbolKey> unused_symbols(arena_);
     for (const auto& kv: use_list_) {
-        if (!kv.second->used()) {
-            unused_symbols.push_back(kv.second->symbol());
+        if (!kv.second.used()) {
+            unused_symbols.push_back(kv.second.symbol());
         }
     }
     return unused_symbols;
 }
 
-const unique_ptr<UseData>& UseList::Get(int index) {
+UseData& UseList::Get(int index) {
     return use_list_.at(index);
 }
 
@@ -346,12 +906,13 @@ public:
           instruction_count_(0), instruction_read_(0),
           last_module_instruction_count_(0),
           current_state_(STATE_MODULE_START), next_state_(STATE_MODULE_START),
-          index_(1), position_(1) {}
+          index_(1), position_(1),
+          instruction_limit_(kMaxUseInstructionsSize) {}
 
     // Public getters.
     int module_index() const { return module_index_; }
     int module_count() const { return module_count_; }
-    std::string last_symbol() const { return last_symbol_; }
+    const base::SymbolKey& last_symbol() const { return last_symbol_; }
     char last_instruction() const { return last_instruction_; }
     int last_module_instruction_count() const {
         return last_module_instruction_count_;
@@ -371,6 +932,15 @@ public:
 
     int position() const { return position_; }
     void position(int position) { position_ = position; }
+
+    // Total instructions allowed before TOO_MANY_INSTR. Raised when the
+    // input is only read to be trimmed down before linking.
+    void instruction_limit(int limit) { instruction_limit_ = limit; }
+
+    // Brings the state up to date after the tokenizer read instructions of
+    // the list by itself: "read" pairs of the list are complete and, if
+    // "type" isn't '\0', the type of the next one is read.
+    void InstructionsRead(int read, char type);
 private:
     // Handle end of previous module and start new module.
     void HandleModuleStart(const base::Token& token);
@@ -389,7 +959,7 @@ private:
 
     int module_index_;  // Memory memory index. Number of instructions before.
     int module_count_;  // Number of modules parsed so far.
-    std::string last_symbol_;  // Last symbol when reading Definition list.
+    base::SymbolKey last_symbol_;  // Last symbol when reading Definition list.
     char last_instruction_; // Last instruction when reading instruction list.
     int definition_read_;  // Number of definitions processed for the module.
     int definition_count_;  // Expected size of definition list.
@@ -405,6 +975,8 @@ private:
     // Current location in file.
     int index_;
     int position_;
+
+    int instruction_limit_;
 };
 
 void ParsingContext::HandleEnd() {
@@ -414,7 +986,7 @@ void ParsingContext::HandleEnd() {
     }
     module_count_++;  // Increase module count.
     module_index_ += instruction_count_;  // Store start index of the module.
-    last_symbol_ = "";
+    last_symbol_ = base::SymbolKey();
     last_instruction_ = '\0';
     definition_read_ = 0;
     use_list_read_ = 0;
@@ -422,7 +994,7 @@ void ParsingContext::HandleEnd() {
     last_module_instruction_count_ = instruction_count_;
     instruction_count_ = 0;
     instruction_read_ = 0;
-    last_symbol_ = "";
+    last_symbol_ = base::SymbolKey();
     next_state_ = STATE_TERMINATED;
 }
 
@@ -440,7 +1012,7 @@ void ParsingContext::HandleModuleStart(const base::Token& token) {
     }
     module_count_++;  // Increase module count.
     module_index_ += instruction_count_;  // Store start index of the module.
-    last_symbol_ = "";
+    last_symbol_ = base::SymbolKey();
     last_instruction_ = '\0';
     definition_read_ = 0;
     use_list_read_ = 0;
@@ -448,7 +1020,7 @@ void ParsingContext::HandleModuleStart(const base::Token& token) {
     last_module_instruction_count_ = instruction_count_;
     instruction_count_ = 0;
     instruction_read_ = 0;
-    last_symbol_ = "";
+    last_symbol_ = base::SymbolKey();
     if (definition_count_ != 0) {
         next_state_ = STATE_READ_DEFINITION_SYMBOL;
     } else {
@@ -495,7 +1067,7 @@ void ParsingContext::HandleUseListStart(const base::Token& token) {
 }
 
 void ParsingContext::HandleUseListRead(const base::Token& token) {
-    std::string symbol;
+    base::SymbolKey symbol;
     if (!token.ReadAsSymbol(&symbol)) {
         next_state_ = STATE_SYNTAX_ERROR;
         return;
@@ -512,7 +1084,7 @@ void ParsingContext::HandleInstructionListStart(const base::Token& token) {
         next_state_ = STATE_SYNTAX_ERROR;
         return;
     }
-    if (instruction_count_ +  module_index_ > kMaxUseInstructionsSize) {
+    if (instruction_count_ +  module_index_ > instruction_limit_) {
         next_state_ = STATE_SYNTAX_ERROR;
         token.err(ERROR_TOO_MANY_INSTR);
         return;
@@ -544,6 +1116,20 @@ void ParsingContext::HandleInstructionCodeRead(const base::Token& token) {
     }
 }
 
+void ParsingContext::InstructionsRead(int read, char type) {
+    instruction_read_ = read;
+    if (type != '\0')
+        last_instruction_ = type;
+    if (instruction_read_ == instruction_count_) {
+        current_state_ = STATE_MODULE_START;
+    } else if (type != '\0') {
+        current_state_ = STATE_INSTRUCTION_CODE_READ;
+    } else {
+        current_state_ = STATE_INSTRUCTION_TYPE_READ;
+    }
+    next_state_ = current_state_;
+}
+
 void ParsingContext::ProcessState(const base::Token& token) {
     // cout << token << " : " << current_state_ << endl;
     switch(current_state_) {
@@ -568,9 +1154,18 @@ void ParsingContext::ProcessState(const base::Token& token) {
     }
 }
 
+// Instruction list of a module, as <type, code> pairs.
+struct InstructionList {
+    const char* types;  // Instruction types, one of A, E, I and R.
+    const int32_t* codes;  // Instruction codes.
+    int count;
+};
+
 class TokenProcessor {
 
 public:
+    virtual ~TokenProcessor() {}
+
     // Hooks that can run after tokenizer creates a token.
     // During it's implementation we can assume that token is syntactically
     // correct. If token fails syntax check then ProcessToken will not be
@@ -593,6 +1188,16 @@ public:
         const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
         const std::unique_ptr<tokenizer::UseList>& use_list) = 0;
 
+    // Hook for the instruction list of a module. The tokenizer reads it in
+    // one go and calls this instead of ProcessToken for its tokens, once
+    // the whole list is read. Not called for empty lists. Ignores the
+    // instructions unless overridden.
+    virtual void ProcessInstructions(
+        const InstructionList& instructions,
+        const std::unique_ptr<ParsingContext>& context,
+        const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+        const std::unique_ptr<tokenizer::UseList>& use_list) {}
+
     // Hooks to provide custom book keeping logic when parsing is completed.
     // Any warning message that is to be handled at the end of the pass
     // will be implemented here.
@@ -602,6 +1207,12 @@ public:
             const std::unique_ptr<tokenizer::UseList>& use_list) = 0;
 };
 
+// Thrown by the tokenizer when a link runs past its deadline.
+class LinkTimeout : public std::runtime_error {
+public:
+    LinkTimeout() : std::runtime_error("Error: link timed out") {}
+};
+
 class Tokenizer {
 public:
 
@@ -610,10 +1221,22 @@ public:
         std::unique_ptr<TokenProcessor> processor,
         std::unique_ptr<SymbolTable> symbol_table);
 
+    // Tokenize an already opened stream instead of a file on disk. Used
+    // by the link server for inline object content.
+    Tokenizer(
+        std::unique_ptr<std::istream> stream,
+        std::unique_ptr<TokenProcessor> processor,
+        std::unique_ptr<SymbolTable> symbol_table);
+
     virtual ~Tokenizer();
 
     void TokenizeFile();
 
+    // Abort tokenizing with a LinkTimeout once this point in time is
+    // passed. Checked once per line and every kDeadlineCheckTokens tokens
+    // within a line, so a single huge line can't run past it.
+    void deadline(std::chrono::steady_clock::time_point d) { deadline_ = d; }
+
     const std::unique_ptr<ParsingContext>& context() const {
         return context_; 
     }
@@ -624,37 +1247,69 @@ public:
 private:
 
     void TokenizeLine(const std::string& line);
+    char* TokenizeInstructions(char* token, const char* line, char** save_ptr);
+    // Counts a token and throws LinkTimeout when the deadline is passed.
+    void CheckDeadline() {
+        if (++tokens_since_check_ < kDeadlineCheckTokens)
+            return;
+        tokens_since_check_ = 0;
+        if (std::chrono::steady_clock::now() > deadline_)
+            throw LinkTimeout();
+    }
+
+    static const int kDeadlineCheckTokens = 4096;
 
     std::unique_ptr<TokenProcessor> token_processor_;
-    const std::string filename_;
-    std::ifstream stream_;
+    std::unique_ptr<std::istream> stream_;
     std::unique_ptr<ParsingContext> context_;
     std::unique_ptr<SymbolTable> symbol_table_;
     std::unique_ptr<UseList> use_list_;
+    std::chrono::steady_clock::time_point deadline_;
+    int tokens_since_check_ = 0;
+    // Instruction list read so far, see TokenizeInstructions.
+    std::vector<char> instruction_types_;
+    std::vector<int32_t> instruction_codes_;
 };
 
 Tokenizer::Tokenizer(
     const std::string& filename, 
     std::unique_ptr<TokenProcessor> processor,
     std::unique_ptr<SymbolTable> symbol_table)
-    : filename_(filename), stream_(filename),
+    : Tokenizer(make_unique<ifstream>(filename), std::move(processor),
+                std::move(symbol_table)) { }
+
+Tokenizer::Tokenizer(
+    std::unique_ptr<std::istream> stream,
+    std::unique_ptr<TokenProcessor> processor,
+    std::unique_ptr<SymbolTable> symbol_table)
+    : token_processor_(std::move(processor)),
+      stream_(std::move(stream)),
       context_(make_unique<ParsingContext>()),
       symbol_table_(std::move(symbol_table)),
-      token_processor_(std::move(processor)),
-      use_list_(make_unique<UseList>()) { }
+      use_list_(make_unique<UseList>(symbol_table_->arena())),
+      deadline_(std::chrono::steady_clock::time_point::max()) { }
 
-Tokenizer::~Tokenizer() {
-    stream_.close();
-}
+Tokenizer::~Tokenizer() {}
 
 void Tokenizer::TokenizeLine(const string& line) {
-    unique_ptr<char[]> cline(new char[line.length() + 1]);
-    strcpy(cline.get(), line.c_str());
-    char* next_token = strtok(cline.get(), kDelimiters);
+    // The line buffer is kept per thread so that a long running process
+    // (e.g. the link server workers) doesn't allocate for every line.
+    static thread_local vector<char> cline;
+    cline.assign(line.c_str(), line.c_str() + line.length() + 1);
+    // strtok_r as several links may be tokenizing on different threads.
+    char* save_ptr = NULL;
+    char* next_token = strtok_r(cline.data(), kDelimiters, &save_ptr);
     context_->position(1);
     while (next_token != NULL) {
-        int token_start = next_token - cline.get() + 1;
-        base::Token t(context_->index(), token_start, string(next_token));
+        if (context_->current_state() == STATE_INSTRUCTION_TYPE_READ ||
+            context_->current_state() == STATE_INSTRUCTION_CODE_READ) {
+            next_token = TokenizeInstructions(
+                next_token, cline.data(), &save_ptr);
+            continue;
+        }
+        CheckDeadline();
+        int token_start = next_token - cline.data() + 1;
+        base::Token t(context_->index(), token_start, next_token);
         context_->ProcessState(t);
         if (context_->next_state() == STATE_SYNTAX_ERROR) {
             // Abort parsing on recieving syntax error.
@@ -666,19 +1321,72 @@ void Tokenizer::TokenizeLine(const string& line) {
         context_->position(token_start + strlen(next_token));
         context_->AdvanceState();
 
-        next_token = strtok(NULL, kDelimiters);
+        next_token = strtok_r(NULL, kDelimiters, &save_ptr);
     }
     context_->position(1 + line.length());
 }
 
+// Fast path of TokenizeLine for the instruction list, which is most of an
+// object file. Reads the <type, code> pairs from "token" on without going
+// through ParsingContext::ProcessState, with the same syntax checks, until
+// the list or the line ends. The complete list goes to the processor in
+// one ProcessInstructions call. Returns the token after the list, NULL at
+// the end of the line.
+char* Tokenizer::TokenizeInstructions(
+        char* token, const char* line, char** save_ptr) {
+    size_t count = context_->instruction_count();
+    // Type of the pair whose code is next, '\0' when a type is next.
+    char type = context_->current_state() == STATE_INSTRUCTION_CODE_READ ?
+        context_->last_instruction() : '\0';
+    while (token != NULL) {
+        CheckDeadline();
+        int token_start = token - line + 1;
+        base::Token t(context_->index(), token_start, token);
+        bool valid;
+        if (type == '\0') {
+            valid = t.ReadAsIAER(&type);
+        } else {
+            int code;
+            valid = t.ReadAsInt(&code);
+            if (valid) {
+                instruction_types_.push_back(type);
+                instruction_codes_.push_back(code);
+                type = '\0';
+            }
+        }
+        context_->position(token_start + strlen(token));
+        if (!valid) {
+            // Abort parsing on recieving syntax error.
+            throw runtime_error(base::ErrorMessageForToken(t));
+        }
+        token = strtok_r(NULL, kDelimiters, save_ptr);
+        if (instruction_codes_.size() == count) {
+            context_->InstructionsRead(count, '\0');
+            InstructionList instructions{instruction_types_.data(),
+                                         instruction_codes_.data(),
+                                         static_cast<int>(count)};
+            token_processor_->ProcessInstructions(
+                instructions, context_, symbol_table_, use_list_);
+            instruction_types_.clear();
+            instruction_codes_.clear();
+            return token;
+        }
+    }
+    context_->InstructionsRead(instruction_codes_.size(), type);
+    return NULL;
+}
+
 void Tokenizer::TokenizeFile() {
     string line;
-    while(getline(stream_, line)) {
+    while(getline(*stream_, line)) {
+        if (std::chrono::steady_clock::now() > deadline_) {
+            throw LinkTimeout();
+        }
         TokenizeLine(line);
         context_->index(context_->index() + 1);  // Increase line index.
     }
     // Move index to last line in case of EOF.
-    if (!stream_.bad() && stream_.eof())
+    if (!stream_->bad() && stream_->eof())
         context_->index(context_->index() - 1);
     context_->HandleEnd();
     if (context_->next_state() != STATE_TERMINATED) {
@@ -694,6 +1402,211 @@ void Tokenizer::TokenizeFile() {
 }
 
 
+// Validate only parser. Runs the ParsingContext state machine from
+// constexpr tables instead of ProcessState and the Handle* methods and
+// does no symbol table, use list or output work.
+
+// What a parser state expects its token to be.
+enum TokenKind {
+    TOKEN_NUMBER,
+    TOKEN_SYMBOL,
+    TOKEN_ADDRESSING,
+};
+
+// Row of the parser transition table. Lists (def list, use list and
+// program text) start with their size, which loads the list counter.
+// The last token of every entry counts it down.
+struct ParserTransition {
+    TokenKind token;
+    bool starts_list;  // The token is the size of a list.
+    bool ends_entry;  // The token ends an entry of the list.
+    int limit;  // Largest list size.
+    bool limit_is_total;  // "limit" applies to the sum of the list sizes.
+    SyntaxError too_large;  // Error for a list size over "limit".
+    ParsingState next;  // Next state within the list.
+    ParsingState done;  // Next state once the list is read or empty.
+};
+
+// Indexed by ParsingState, same transitions as ParsingContext.
+constexpr ParserTransition kParserTransitions[] = {
+    // STATE_MODULE_START
+    {TOKEN_NUMBER, true, false, kMaxDefinitionListSize, false,
+     ERROR_TOO_MANY_DEF_IN_MODULE, STATE_READ_DEFINITION_SYMBOL,
+     STATE_USE_LIST_START},
+    // STATE_READ_DEFINITION_SYMBOL
+    {TOKEN_SYMBOL, false, false, 0, false, ERROR_OK,
+     STATE_READ_DEFINITION_VALUE, STATE_READ_DEFINITION_VALUE},
+    // STATE_READ_DEFINITION_VALUE
+    {TOKEN_NUMBER, false, true, 0, false, ERROR_OK,
+     STATE_READ_DEFINITION_SYMBOL, STATE_USE_LIST_START},
+    // STATE_USE_LIST_START
+    {TOKEN_NUMBER, true, false, kMaxUseListSize, false,
+     ERROR_TOO_MANY_USE_IN_MODULE, STATE_USE_LIST_READ,
+     STATE_INSTRUCTION_LIST_START},
+    // STATE_USE_LIST_READ
+    {TOKEN_SYMBOL, false, true, 0, false, ERROR_OK, STATE_USE_LIST_READ,
+     STATE_INSTRUCTION_LIST_START},
+    // STATE_INSTRUCTION_LIST_START
+    {TOKEN_NUMBER, true, false, kMaxUseInstructionsSize, true,
+     ERROR_TOO_MANY_INSTR, STATE_INSTRUCTION_TYPE_READ, STATE_MODULE_START},
+    // STATE_INSTRUCTION_TYPE_READ
+    {TOKEN_ADDRESSING, false, false, 0, false, ERROR_OK,
+     STATE_INSTRUCTION_CODE_READ, STATE_INSTRUCTION_CODE_READ},
+    // STATE_INSTRUCTION_CODE_READ
+    {TOKEN_NUMBER, false, true, 0, false, ERROR_OK,
+     STATE_INSTRUCTION_TYPE_READ, STATE_MODULE_START},
+};
+
+// Character classes of the token checks.
+enum CharClass : uint8_t {
+    CHAR_DELIMITER = 1,  // One of kDelimiters.
+    CHAR_DIGIT = 2,
+    CHAR_ALPHA = 4,
+    CHAR_ADDRESSING = 8,  // I, A, E or R.
+    CHAR_SPACE = 16,  // Other white space, skipped by std::stoi.
+};
+
+constexpr std::array<uint8_t, 256> MakeCharClasses() {
+    std::array<uint8_t, 256> classes{};
+    classes[' '] = classes['\t'] = classes['\n'] = classes['\r'] =
+        CHAR_DELIMITER;
+    classes['\v'] = classes['\f'] = CHAR_SPACE;
+    for (int c = '0'; c <= '9'; c++)
+        classes[c] = CHAR_DIGIT;
+    for (int c = 'a'; c <= 'z'; c++)
+        classes[c] = CHAR_ALPHA;
+    for (int c = 'A'; c <= 'Z'; c++)
+        classes[c] = CHAR_ALPHA;
+    for (char c : {'I', 'A', 'E', 'R'})
+        classes[static_cast<uint8_t>(c)] |= CHAR_ADDRESSING;
+    return classes;
+}
+
+constexpr std::array<uint8_t, 256> kCharClasses = MakeCharClasses();
+
+inline uint8_t CharClassOf(char c) {
+    return kCharClasses[static_cast<uint8_t>(c)];
+}
+
+// Same result as Token::ReadAsInt.
+bool ScanInt(const char* begin, const char* end, int* value) {
+    const char* p = begin;
+    while (p != end && (CharClassOf(*p) & CHAR_SPACE))
+        p++;
+    bool negative = false;
+    if (p != end && (*p == '+' || *p == '-'))
+        negative = *p++ == '-';
+    if (p == end)
+        return false;
+    int64_t magnitude = 0;
+    for (; p != end; p++) {
+        if (!(CharClassOf(*p) & CHAR_DIGIT))
+            return false;
+        magnitude = magnitude * 10 + (*p - '0');
+        if (magnitude > int64_t{std::numeric_limits<int>::max()} + 1)
+            return false;
+    }
+    int64_t result = negative ? -magnitude : magnitude;
+    if (result > std::numeric_limits<int>::max())
+        return false;
+    *value = result;
+    return true;
+}
+
+// Checks the token against what "kind" expects. Returns the error of the
+// matching Token::ReadAs* method, ERROR_OK if the token is valid.
+SyntaxError ScanToken(TokenKind kind, const char* begin, const char* end,
+                      int* value) {
+    size_t length = end - begin;
+    switch (kind) {
+        case TOKEN_NUMBER:
+            return ScanInt(begin, end, value) ? ERROR_OK : ERROR_NUM_EXPECTED;
+        case TOKEN_SYMBOL:
+            if (length > kMaxSymbolLength)
+                return ERROR_SYM_TOO_LONG;
+            if (length == 0 || !(CharClassOf(*begin) & CHAR_ALPHA))
+                return ERROR_SYM_EXPECTED;
+            for (const char* p = begin + 1; p != end; p++) {
+                if (!(CharClassOf(*p) & (CHAR_ALPHA | CHAR_DIGIT)))
+                    return ERROR_SYM_EXPECTED;
+            }
+            return ERROR_OK;
+        case TOKEN_ADDRESSING:
+            return length == 1 && (CharClassOf(*begin) & CHAR_ADDRESSING) ?
+                ERROR_OK : ERROR_ADDR_EXPECTED;
+    }
+    return ERROR_OK;
+}
+
+// Checks the syntax of an object file. Returns the parse error message a
+// link of "text" would print first, or an empty string if it is valid.
+std::string CheckSyntax(std::string_view text) {
+    ParsingState state = STATE_MODULE_START;
+    int remaining = 0;  // Entries left in the current list.
+    int total_instructions = 0;
+    int line_num = 0;
+    const char* data = text.data();
+    const char* text_end = data + text.size();
+    int line_length = 0;  // Length of the last line, without the newline.
+    const char* line = data;
+    while (line != text_end) {
+        const char* line_end;
+        line_end = static_cast<const char*>(
+            memchr(line, '\n', text_end - line));
+        if (line_end == nullptr)
+            line_end = text_end;
+        line_num++;
+        line_length = line_end - line;
+        // Tokens end at a NUL byte, as with strtok on the line.
+        const char* tokens_end = static_cast<const char*>(
+            memchr(line, '\0', line_end - line));
+        if (tokens_end == nullptr)
+            tokens_end = line_end;
+        const char* p = line;
+        while (true) {
+            while (p != tokens_end && (CharClassOf(*p) & CHAR_DELIMITER))
+                p++;
+            if (p == tokens_end)
+                break;
+            const char* token = p;
+            while (p != tokens_end && !(CharClassOf(*p) & CHAR_DELIMITER))
+                p++;
+            const ParserTransition& transition = kParserTransitions[state];
+            int value = 0;
+            SyntaxError error = ScanToken(transition.token, token, p, &value);
+            if (error == ERROR_OK && transition.starts_list) {
+                int used = transition.limit_is_total ? total_instructions : 0;
+                if (value + used > transition.limit)
+                    error = transition.too_large;
+                if (transition.limit_is_total)
+                    total_instructions += value;
+                remaining = value;
+            }
+            if (error != ERROR_OK) {
+                base::Token t(line_num, token - line + 1, "");
+                t.err(error);
+                return base::ErrorMessageForToken(t);
+            }
+            if (transition.starts_list) {
+                state = remaining != 0 ? transition.next : transition.done;
+            } else if (transition.ends_entry) {
+                state = --remaining == 0 ? transition.done : transition.next;
+            } else {
+                state = transition.next;
+            }
+        }
+        line = line_end == text_end ? text_end : line_end + 1;
+    }
+    if (state == STATE_MODULE_START)
+        return "";
+    // Missing tokens are reported after the last character of the input,
+    // with the error for an empty token.
+    int value;
+    base::Token t(line_num, line_length + 1, "");
+    t.err(ScanToken(kParserTransitions[state].token, data, data, &value));
+    return base::ErrorMessageForToken(t);
+}
+
 }  // namespace tokenizer
 
 namespace linker {
@@ -707,6 +1620,16 @@ public:
         const std::unique_ptr<tokenizer::UseList>& use_list) {
         cout << token << endl;
     }
+    void ProcessInstructions(
+        const tokenizer::InstructionList& instructions,
+        const unique_ptr<tokenizer::ParsingContext>& context,
+        const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+        const std::unique_ptr<tokenizer::UseList>& use_list) {
+        for (int i = 0; i < instructions.count; i++) {
+            cout << "Instruction: " << instructions.types[i] << " "
+                 << instructions.codes[i] << endl;
+        }
+    }
     void Stop(
             const std::unique_ptr<tokenizer::ParsingContext>& context,
             const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
@@ -716,8 +1639,42 @@ public:
     }
 };
 
+// Rule policies. They select at compile time which of the verification
+// rules a link runs, so the checks a build doesn't need are compiled out
+// of the token processors below.
+//
+// kWarnings: Rule 4, 5 and 7 warnings and the use tracking they need.
+// kVerifyInput: Rule 5 bounds fix and the Rule 8, 9, 10 & 11 checks on
+//     instructions. Only inputs known to be valid may skip these. Rule 6
+//     is checked with every policy as an E operand past the use list
+//     would read out of bounds.
+struct FullChecking {
+    static constexpr bool kWarnings = true;
+    static constexpr bool kVerifyInput = true;
+};
+
+struct NoWarnings {
+    static constexpr bool kWarnings = false;
+    static constexpr bool kVerifyInput = true;
+};
+
+struct TrustedInput {
+    static constexpr bool kWarnings = false;
+    static constexpr bool kVerifyInput = false;
+};
+
+// Run time selection of the rule policy, from the command line.
+enum RuleMode {
+    RULES_FULL = 0,  // FullChecking, the default.
+    RULES_NO_WARNINGS,  // NoWarnings (--no-warnings).
+    RULES_TRUSTED_INPUT,  // TrustedInput (--trusted-input).
+};
+
+template <typename Policy>
 class SymbolTableGenerator : public tokenizer::TokenProcessor {
 public:
+    explicit SymbolTableGenerator(std::ostream& out) : out_(out) {}
+
     void ProcessToken(
             const base::Token& token,
             const std::unique_ptr<tokenizer::ParsingContext>& context,
@@ -732,9 +1689,12 @@ private:
             const std::unique_ptr<tokenizer::ParsingContext>& context,
             const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
             const std::unique_ptr<tokenizer::UseList>& use_list);
+
+    std::ostream& out_;  // Link output, warnings are written here.
 };
 
-void SymbolTableGenerator::ProcessToken(
+template <typename Policy>
+void SymbolTableGenerator<Policy>::ProcessToken(
         const base::Token& token,
         const std::unique_ptr<tokenizer::ParsingContext>& context,
         const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
@@ -753,17 +1713,22 @@ void SymbolTableGenerator::ProcessToken(
     }
 }
 
-void SymbolTableGenerator::Stop(
+template <typename Policy>
+void SymbolTableGenerator<Policy>::Stop(
         const std::unique_ptr<tokenizer::ParsingContext>& context,
         const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
         const std::unique_ptr<tokenizer::UseList>& use_list) {
     HandleModuleChange(context, symbol_table, use_list);
 }
 
-void SymbolTableGenerator::HandleModuleChange(
+template <typename Policy>
+void SymbolTableGenerator<Policy>::HandleModuleChange(
         const std::unique_ptr<tokenizer::ParsingContext>& context,
         const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
         const std::unique_ptr<tokenizer::UseList>& use_list) {
+    if constexpr (!Policy::kVerifyInput) {
+        return;
+    }
     int module_size = context->last_module_instruction_count();
     int last_module_number = context->module_count() - 1;
     if (last_module_number < 0)
@@ -771,42 +1736,483 @@ void SymbolTableGenerator::HandleModuleChange(
     // Rule 5: Verify that all the symbols added in this module
     // where within the module size.
     symbol_table->VerifySymbol(
-        last_module_number, module_size, context->module_index());
+        last_module_number, module_size, context->module_index(), out_,
+        Policy::kWarnings);
 }
 
 
-class InstructionGenerator : public tokenizer::TokenProcessor {
+static const char* kSymbolIndexMagic = "!<linkmap>";
+
+// Maps addresses of the linked program back to their module and the
+// nearest symbol at or before them. Built by a link (see
+// LinkOptions::symbol_index) and saved next to its output so tools don't
+// parse the memory map. The file is
+//   !<linkmap>
+//   <module count>
+//   <base address> <instruction count> <source file or ->   (per module)
+//   <symbol count>
+//   <address> <module> <symbol>   (by address, then definition order)
+class SymbolIndex {
 public:
-    virtual void Stop(
-            const std::unique_ptr<tokenizer::ParsingContext>& context,
-            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
-            const std::unique_ptr<tokenizer::UseList>& use_list) override;
-    virtual void ProcessToken(
-            const base::Token& token,
-            const std::unique_ptr<tokenizer::ParsingContext>& context,
-            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
-            const std::unique_ptr<tokenizer::UseList>& use_list) override;
+    SymbolIndex() = default;
+    // Reads an index written by Write. Throws runtime_error if the file
+    // isn't one.
+    explicit SymbolIndex(const std::string& filename);
+
+    // Modules must be added in program order. "source" may be empty.
+    void AddModule(int base, int size, const std::string& source);
+    // Symbols must be added in definition order, then sorted once.
+    void AddSymbol(const base::SymbolKey& symbol, int address, int module);
+    void SortSymbols();
+
+    void Write(std::ostream& out) const;
+
+    // Writes "Module <n> [(<source>)] [<symbol>+<offset>]" for "address",
+    // the symbol being the nearest one of that module at or before the
+    // address. Returns false if the address isn't in the program.
+    bool Symbolize(int address, std::ostream& out) const;
 private:
-
-    void HandleModuleChange(
-            const std::unique_ptr<tokenizer::ParsingContext>& context,
-            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
-            const std::unique_ptr<tokenizer::UseList>& use_list);
+    struct ModuleRange {
+        int base;
+        int size;
+        std::string source;
+    };
+    struct SymbolAddress {
+        int address;
+        int module;
+        base::SymbolKey symbol;
+    };
+    std::vector<ModuleRange> modules_;  // By base address.
+    std::vector<SymbolAddress> symbols_;  // By address once sorted.
 };
 
-// Prints warning at the end of pass 2.
-void InstructionGenerator::Stop(
-        const std::unique_ptr<tokenizer::ParsingContext>& context,
-        const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
-        const std::unique_ptr<tokenizer::UseList>& use_list) {
-    HandleModuleChange(context, symbol_table, use_list);
-    // Rule 4: Verify all symbols are used.
-    // If a symbol is defined but not used, print a warning message & continue.
-    symbol_table->VerifySymbolUsed();
+SymbolIndex::SymbolIndex(const std::string& filename) {
+    std::ifstream in(filename);
+    std::string magic;
+    size_t module_count, symbol_count;
+    if (!getline(in, magic) || magic != kSymbolIndexMagic ||
+        !(in >> module_count)) {
+        throw runtime_error("Error: " + filename + " is not a symbol index");
+    }
+    for (size_t i = 0; i < module_count; i++) {
+        ModuleRange module;
+        in >> module.base >> module.size >> std::ws;
+        getline(in, module.source);
+        if (module.source == "-")
+            module.source.clear();
+        modules_.push_back(std::move(module));
+    }
+    in >> symbol_count;
+    std::string symbol;
+    SymbolAddress symbol_address;
+    for (size_t i = 0; i < symbol_count &&
+         in >> symbol_address.address >> symbol_address.module >> symbol;
+         i++) {
+        if (symbol.length() > kMaxSymbolLength)
+            in.setstate(ios::failbit);
+        symbol_address.symbol =
+            base::SymbolKey(symbol.substr(0, kMaxSymbolLength));
+        symbols_.push_back(symbol_address);
+    }
+    if (!in) {
+        throw runtime_error("Error: " + filename + " is a corrupt symbol index");
+    }
+}
+
+void SymbolIndex::AddModule(int base, int size, const std::string& source) {
+    modules_.push_back({base, size, source});
+}
+
+void SymbolIndex::AddSymbol(
+        const base::SymbolKey& symbol, int address, int module) {
+    symbols_.push_back({address, module, symbol});
+}
+
+void SymbolIndex::SortSymbols() {
+    // Stable so that symbols at the same address keep definition order.
+    std::stable_sort(symbols_.begin(), symbols_.end(),
+                     [](const SymbolAddress& a, const SymbolAddress& b) {
+                         return a.address < b.address;
+                     });
+}
+
+void SymbolIndex::Write(std::ostream& out) const {
+    out << kSymbolIndexMagic << endl << modules_.size() << endl;
+    for (const auto& module : modules_) {
+        out << module.base << " " << module.size << " "
+            << (module.source.empty() ? "-" : module.source) << endl;
+    }
+    out << symbols_.size() << endl;
+    for (const auto& symbol : symbols_) {
+        out << symbol.address << " " << symbol.module << " " << symbol.symbol
+            << endl;
+    }
+}
+
+bool SymbolIndex::Symbolize(int address, std::ostream& out) const {
+    // Last module starting at or before the address. Modules without
+    // instructions share the base of the next one and never match.
+    auto module = std::upper_bound(
+        modules_.begin(), modules_.end(), address,
+        [](int address, const ModuleRange& module) {
+            return address < module.base;
+        });
+    if (module == modules_.begin() || address < 0)
+        return false;
+    --module;
+    if (address >= module->base + module->size)
+        return false;
+    int module_number = module - modules_.begin() + 1;
+    out << "Module " << module_number;
+    if (!module->source.empty())
+        out << " (" << module->source << ")";
+    // Symbols from the module base up to the address. Symbols of other
+    // modules in that range (e.g. of an empty module sharing the base, or
+    // values left outside their module with --trusted-input) are skipped.
+    auto last = std::upper_bound(
+        symbols_.begin(), symbols_.end(), address,
+        [](int address, const SymbolAddress& symbol) {
+            return address < symbol.address;
+        });
+    auto first = std::lower_bound(
+        symbols_.begin(), last, module->base,
+        [](const SymbolAddress& symbol, int address) {
+            return symbol.address < address;
+        });
+    // Walking back, the last match at the nearest address is the first
+    // defined one.
+    auto nearest = last;
+    for (auto symbol = last; symbol != first;) {
+        --symbol;
+        if (symbol->module != module_number)
+            continue;
+        if (nearest != last && symbol->address != nearest->address)
+            break;
+        nearest = symbol;
+    }
+    if (nearest != last)
+        out << " " << nearest->symbol << "+" << address - nearest->address;
+    return true;
+}
+
+// Outcome of relocating one instruction. Rule numbers as in the lab
+// specification.
+enum RelocationError : int32_t {
+    RELOCATION_OK = 0,
+    RELOCATION_ILLEGAL_OPCODE,  // Rule 11.
+    RELOCATION_ABSOLUTE_OVERFLOW,  // Rule 8.
+    RELOCATION_IMMEDIATE_OVERFLOW,  // Rule 10.
+    RELOCATION_RELATIVE_OVERFLOW,  // Rule 9.
+    RELOCATION_EXTERNAL_OVERFLOW,  // Rule 6.
+    RELOCATION_UNDEFINED_SYMBOL,  // Rule 3.
+};
+
+// Instruction list of one module and the arrays its relocation is written
+// to. All the arrays have "count" entries.
+struct RelocationBatch {
+    const char* types;  // Instruction types, one of A, E, I and R.
+    const int32_t* codes;  // Instruction codes as read.
+    int count;
+    int module_index;  // Address of the first instruction of the module.
+    // Value of the symbol of every use list entry, -1 if it is undefined.
+    const int32_t* externals;
+    int external_count;
+    int32_t* relocated;  // Output, relocated instruction codes.
+    int32_t* errors;  // Output, a RelocationError per instruction.
+};
+
+// Relocates instruction "i" of the batch. Rule 6 is checked with all
+// policies as the use list can't be read out of bounds.
+template <typename Policy>
+inline void RelocateInstruction(const RelocationBatch& batch, int i) {
+    char type = batch.types[i];
+    int instruction = batch.codes[i];
+    int op_code = instruction / kMaxOperand;
+    int operand = instruction % kMaxOperand;
+    int32_t error = RELOCATION_OK;
+    // Instruction code I doesn't have an op_code. For every other
+    // instruction type, the op_code must be less than 10. (Rule 11).
+    if (Policy::kVerifyInput && op_code >= kMaxOpCode && type != 'I') {
+        // Rule: 11 Change instruction to the largest instruction.
+        instruction = kInvalidInstructionCodeOverflow;
+        error = RELOCATION_ILLEGAL_OPCODE;
+    } else if (type == 'A') {
+        // Instruction type A is left unchanged unless the operand exceed
+        // memory size.
+        if (Policy::kVerifyInput && operand >= kMemorySize) {
+            // Rule: 8
+            instruction = kMaxOperand * op_code +
+                kInvalidInstructionCodeUnderflow;
+            error = RELOCATION_ABSOLUTE_OVERFLOW;
+        }
+    } else if (type == 'I') {
+        // Intruction type I is left unchanged except when memory overflow.
+        if (Policy::kVerifyInput &&
+            instruction > kInvalidInstructionCodeOverflow) {
+            // Rule: 10
+            instruction = kInvalidInstructionCodeOverflow;
+            error = RELOCATION_IMMEDIATE_OVERFLOW;
+        }
+    } else if (type == 'R') {
+        // Relative instructions added to module index.
+        if (Policy::kVerifyInput && operand >= batch.count) {
+            // Rule: 9
+            operand = kInvalidInstructionCodeUnderflow;
+            error = RELOCATION_RELATIVE_OVERFLOW;
+        }
+        instruction = kMaxOperand * op_code + operand + batch.module_index;
+    } else if (operand < 0 || operand >= batch.external_count) {
+        // Rule 6: If an external address is too large to reference an
+        // entry in the use list, treat the address as immediate.
+        error = RELOCATION_EXTERNAL_OVERFLOW;
+    } else {
+        // Map address using external symbols.
+        operand = batch.externals[operand];
+        if (operand == -1) {
+            // Rule 3: Symbol value doesn't exist.
+            operand = kInvalidInstructionCodeUnderflow;
+            error = RELOCATION_UNDEFINED_SYMBOL;
+        }
+        instruction = kMaxOperand * op_code + operand;
+    }
+    batch.relocated[i] = instruction;
+    batch.errors[i] = error;
+}
+
+// Reference relocation, one instruction at a time.
+template <typename Policy>
+void RelocateScalar(const RelocationBatch& batch) {
+    for (int i = 0; i < batch.count; i++)
+        RelocateInstruction<Policy>(batch, i);
+}
+
+#if defined(LINKER_CPU_DISPATCH)
+// Relocates 8 instructions at a time. Codes in [0, 9999] are split with a
+// multiply-shift (x * 8389 >> 23 == x / 1000 in that range) and every rule
+// is applied to all the lanes with blends. Negative codes, and codes above
+// 9999 when the input isn't verified, are left to RelocateInstruction.
+// Gives the same result as RelocateScalar. Only called when the CPU has
+// AVX2.
+template <typename Policy>
+__attribute__((target("avx2")))
+void RelocateAvx2(const RelocationBatch& batch) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max_code = _mm256_set1_epi32(kInvalidInstructionCodeOverflow);
+    const __m256i max_operand = _mm256_set1_epi32(kMaxOperand);
+    const __m256i module_index = _mm256_set1_epi32(batch.module_index);
+    const __m256i module_size = _mm256_set1_epi32(batch.count);
+    const __m256i external_count = _mm256_set1_epi32(batch.external_count);
+    const __m256i undefined = _mm256_set1_epi32(-1);
+    int i = 0;
+    for (; i + 8 <= batch.count; i += 8) {
+        __m256i code = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(batch.codes + i));
+        __m256i type = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(batch.types + i)));
+        __m256i is_a = _mm256_cmpeq_epi32(type, _mm256_set1_epi32('A'));
+        __m256i is_i = _mm256_cmpeq_epi32(type, _mm256_set1_epi32('I'));
+        __m256i is_r = _mm256_cmpeq_epi32(type, _mm256_set1_epi32('R'));
+        __m256i is_e = _mm256_cmpeq_epi32(type, _mm256_set1_epi32('E'));
+        __m256i negative = _mm256_cmpgt_epi32(zero, code);
+        __m256i over = _mm256_cmpgt_epi32(code, max_code);
+        __m256i scalar = Policy::kVerifyInput ?
+            negative : _mm256_or_si256(negative, over);
+
+        __m256i op_code = _mm256_srli_epi32(
+            _mm256_mullo_epi32(code, _mm256_set1_epi32(8389)), 23);
+        __m256i op_base = _mm256_mullo_epi32(op_code, max_operand);
+        __m256i operand = _mm256_sub_epi32(code, op_base);
+
+        __m256i result = code;
+        __m256i error = zero;
+        if constexpr (Policy::kVerifyInput) {
+            // Rule 8.
+            __m256i bad = _mm256_and_si256(is_a, _mm256_cmpgt_epi32(
+                operand, _mm256_set1_epi32(kMemorySize - 1)));
+            result = _mm256_blendv_epi8(result, op_base, bad);
+            error = _mm256_blendv_epi8(
+                error, _mm256_set1_epi32(RELOCATION_ABSOLUTE_OVERFLOW), bad);
+        }
+        // Rule 9 and the base address of R.
+        __m256i r_operand = operand;
+        if constexpr (Policy::kVerifyInput) {
+            __m256i bad = _mm256_and_si256(
+                is_r, _mm256_cmpgt_epi32(module_size, operand));
+            bad = _mm256_andnot_si256(bad, is_r);
+            r_operand = _mm256_andnot_si256(bad, operand);
+            error = _mm256_blendv_epi8(
+                error, _mm256_set1_epi32(RELOCATION_RELATIVE_OVERFLOW), bad);
+        }
+        result = _mm256_blendv_epi8(result, _mm256_add_epi32(
+            op_base, _mm256_add_epi32(r_operand, module_index)), is_r);
+        // Rule 6 and 3, E gathers the symbol values of the use list.
+        __m256i in_use_list = _mm256_and_si256(
+            is_e, _mm256_cmpgt_epi32(external_count, operand));
+        in_use_list = _mm256_andnot_si256(
+            _mm256_or_si256(over, negative), in_use_list);
+        __m256i value = _mm256_mask_i32gather_epi32(
+            undefined, batch.externals, operand, in_use_list, 4);
+        __m256i is_undefined = _mm256_and_si256(
+            in_use_list, _mm256_cmpeq_epi32(value, undefined));
+        value = _mm256_andnot_si256(is_undefined, value);
+        result = _mm256_blendv_epi8(
+            result, _mm256_add_epi32(op_base, value), in_use_list);
+        error = _mm256_blendv_epi8(
+            error, _mm256_set1_epi32(RELOCATION_UNDEFINED_SYMBOL),
+            is_undefined);
+        error = _mm256_blendv_epi8(
+            error, _mm256_set1_epi32(RELOCATION_EXTERNAL_OVERFLOW),
+            _mm256_andnot_si256(in_use_list, is_e));
+        if constexpr (Policy::kVerifyInput) {
+            // Rule 10 and 11, codes above 9999 become 9999.
+            result = _mm256_blendv_epi8(result, max_code, over);
+            error = _mm256_blendv_epi8(error, _mm256_blendv_epi8(
+                _mm256_set1_epi32(RELOCATION_ILLEGAL_OPCODE),
+                _mm256_set1_epi32(RELOCATION_IMMEDIATE_OVERFLOW), is_i),
+                over);
+        }
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(batch.relocated + i), result);
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(batch.errors + i), error);
+
+        unsigned scalar_lanes =
+            _mm256_movemask_ps(_mm256_castsi256_ps(scalar));
+        while (scalar_lanes) {
+            RelocateInstruction<Policy>(batch, i + __builtin_ctz(scalar_lanes));
+            scalar_lanes &= scalar_lanes - 1;
+        }
+    }
+    for (; i < batch.count; i++)
+        RelocateInstruction<Policy>(batch, i);
+}
+#endif
+
+// Relocates the instruction list of a module, with AVX2 when the CPU has
+// it and the scalar kernel otherwise.
+template <typename Policy>
+void Relocate(const RelocationBatch& batch) {
+#if defined(LINKER_CPU_DISPATCH)
+    if (base::kCpu.avx2) {
+        RelocateAvx2<Policy>(batch);
+        return;
+    }
+#endif
+    RelocateScalar<Policy>(batch);
+}
+
+// Differential check of Relocate against RelocateScalar on random
+// batches with every rule triggered. Returns false and describes the first
+// mismatch on "out" if they differ.
+template <typename Policy>
+bool VerifyRelocation(int iterations, std::ostream& out) {
+    std::mt19937 random(iterations);
+    auto pick = [&](int low, int high) {
+        return std::uniform_int_distribution<int>(low, high)(random);
+    };
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        int count = pick(0, 64);
+        std::vector<char> types(count);
+        std::vector<int32_t> codes(count);
+        for (int i = 0; i < count; i++) {
+            types[i] = "AEIR"[pick(0, 3)];
+            switch (pick(0, 9)) {
+                case 0: codes[i] = pick(-20000, -1); break;
+                case 1: codes[i] = pick(10000, 100000); break;
+                case 2: codes[i] = pick(0, 9) * kMaxOperand + pick(0, 999);
+                        break;
+                default: codes[i] = pick(0, 9) * kMaxOperand + pick(0, 70);
+            }
+        }
+        std::vector<int32_t> externals(pick(0, 16));
+        for (auto& external : externals)
+            external = pick(0, 3) == 0 ? -1 : pick(0, kMemorySize - 1);
+        std::vector<int32_t> expected(count), expected_errors(count);
+        std::vector<int32_t> relocated(count), errors(count);
+        RelocationBatch batch{types.data(), codes.data(), count,
+                              pick(0, kMemorySize), externals.data(),
+                              static_cast<int>(externals.size()),
+                              expected.data(), expected_errors.data()};
+        RelocateScalar<Policy>(batch);
+        batch.relocated = relocated.data();
+        batch.errors = errors.data();
+        Relocate<Policy>(batch);
+        for (int i = 0; i < count; i++) {
+            if (relocated[i] != expected[i] || errors[i] != expected_errors[i]) {
+                out << "Relocation mismatch: " << types[i] << " " << codes[i]
+                    << " -> " << relocated[i] << " (error " << errors[i]
+                    << "), expected " << expected[i] << " (error "
+                    << expected_errors[i] << ")" << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename Policy>
+class InstructionGenerator : public tokenizer::TokenProcessor {
+public:
+    // Module ranges and symbol addresses are added to "symbol_index" if it
+    // isn't null.
+    explicit InstructionGenerator(std::ostream& out,
+                                  SymbolIndex* symbol_index = nullptr)
+        : out_(out), symbol_index_(symbol_index) {}
+
+    virtual void Stop(
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list) override;
+    virtual void ProcessToken(
+            const base::Token& token,
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list) override;
+    virtual void ProcessInstructions(
+            const tokenizer::InstructionList& instructions,
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list) override;
+private:
+
+    void HandleModuleChange(
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list);
+
+    std::ostream& out_;  // Memory map and warnings are written here.
+    SymbolIndex* symbol_index_;  // Not owned, may be null.
+    // Relocation of the current module, kept between modules to reuse the
+    // buffers.
+    std::vector<int32_t> externals_;
+    std::vector<int32_t> relocated_;
+    std::vector<int32_t> errors_;
+};
+
+// Prints warning at the end of pass 2.
+template <typename Policy>
+void InstructionGenerator<Policy>::Stop(
+        const std::unique_ptr<tokenizer::ParsingContext>& context,
+        const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+        const std::unique_ptr<tokenizer::UseList>& use_list) {
+    HandleModuleChange(context, symbol_table, use_list);
+    // Rule 4: Verify all symbols are used.
+    // If a symbol is defined but not used, print a warning message & continue.
+    if constexpr (Policy::kWarnings) {
+        symbol_table->VerifySymbolUsed(out_);
+    }
+    if (symbol_index_ != nullptr) {
+        symbol_table->ForEachSymbol(
+            [this](const base::SymbolKey& symbol, int value, int module) {
+                symbol_index_->AddSymbol(symbol, value, module);
+            });
+        symbol_index_->SortSymbols();
+    }
 }
 
 // Main logic for pass 2.
-void InstructionGenerator::ProcessToken(
+template <typename Policy>
+void InstructionGenerator<Policy>::ProcessToken(
         const base::Token& token,
         const std::unique_ptr<tokenizer::ParsingContext>& context,
         const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
@@ -816,95 +2222,88 @@ void InstructionGenerator::ProcessToken(
         // symbols from last module).
         HandleModuleChange(context, symbol_table, use_list);
     }
+    if (context->current_state() == tokenizer::STATE_INSTRUCTION_LIST_START &&
+        symbol_index_ != nullptr) {
+        const std::string* source =
+            symbol_table->Module(context->module_count()).source;
+        symbol_index_->AddModule(context->module_index(),
+                                 context->instruction_count(),
+                                 source ? *source : "");
+    }
     if (context->current_state() == tokenizer::STATE_USE_LIST_READ) {
         // Parsing the use list. Add these symbols into use_list.
-        string symbol;
+        base::SymbolKey symbol;
         token.ReadAsSymbol(&symbol);
         use_list->AddSymbol(symbol, context->use_list_index());
     }
-    if (context->current_state() ==
-        tokenizer::STATE_INSTRUCTION_CODE_READ) {
-        // Succesfully read a <Instruction Type: Instruction Code> pair.
-        // Output it in mmeory map.
-        char instruction_type = context->last_instruction();
-        int instruction;
-        token.ReadAsInt(&instruction);  // A Processor won't see syntax error.
-        int op_code = instruction / kMaxOperand;
-        int operand = instruction % kMaxOperand;
-        string err;
-        // Instruction code I doesn't have an op_code. For every other
-        // instruction type, the op_code must be less than 10. (Rule 11).
-        if (op_code >= kMaxOpCode && instruction_type != 'I') {
-            // Rule: 11 Change instruction to the largest instruction.
-            instruction = kInvalidInstructionCodeOverflow;
-            err = "Error: Illegal opcode; treated as 9999";
-        } else {
-            switch(instruction_type) {
-            case 'A':  
-                // Instruction type A is left unchanged unless the operand
-                // exceed memory size.
-                if (operand >= kMemorySize) {
-                    // Rule: 8
-                    instruction =
-                        kMaxOperand * op_code + kInvalidInstructionCodeUnderflow;
-                    err = "Error: Absolute address exceeds machine size; zero used";
-                }
+}
+
+// Relocates the instruction list of the current module as a whole and
+// prints it in the memory map.
+template <typename Policy>
+void InstructionGenerator<Policy>::ProcessInstructions(
+        const tokenizer::InstructionList& instructions,
+        const std::unique_ptr<tokenizer::ParsingContext>& context,
+        const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+        const std::unique_ptr<tokenizer::UseList>& use_list) {
+    // Resolve the use list once, instructions only index it.
+    externals_.clear();
+    for (int i = 0; i < use_list->size(); i++) {
+        externals_.push_back(
+            symbol_table->Value(use_list->Get(i).symbol(), false));
+    }
+    int count = instructions.count;
+    relocated_.resize(count);
+    errors_.resize(count);
+    RelocationBatch batch{instructions.types, instructions.codes, count,
+                          context->module_index(), externals_.data(),
+                          use_list->size(), relocated_.data(),
+                          errors_.data()};
+    Relocate<Policy>(batch);
+
+    for (int i = 0; i < count; i++) {
+        // Print instruction on console.
+        out_ << std::setfill('0') << std::setw(3)
+             << context->module_index() + i;
+        out_ << ": " << std::setfill('0') << std::setw(4) << relocated_[i];
+        switch (errors_[i]) {
+            case RELOCATION_ILLEGAL_OPCODE:
+                out_ << " Error: Illegal opcode; treated as 9999";
                 break;
-            case 'I':
-                // Intruction type I is left unchanged except when memory
-                // overflow.
-                if (instruction > kInvalidInstructionCodeOverflow) {
-                    // Rule: 10
-                    instruction = kInvalidInstructionCodeOverflow;
-                    err = "Error: Illegal immediate value; treated as 9999";
-                }
+            case RELOCATION_ABSOLUTE_OVERFLOW:
+                out_ << " Error: Absolute address exceeds machine size; "
+                    "zero used";
                 break;
-            case 'R':
-                // Relative instructions added to module index. Note that
-                // relative address can't exceed number of instruction in
-                // the module. Also total number of isntruction is 512. Thus
-                // the operand will never exceed 512.
-                if (operand >= context->instruction_count()) {
-                    // Rule: 9
-                    operand = kInvalidInstructionCodeUnderflow;
-                    err = "Error: Relative address exceeds module size; zero used";
-                }
-                operand += context->module_index();
-                instruction = kMaxOperand * op_code + operand;
+            case RELOCATION_IMMEDIATE_OVERFLOW:
+                out_ << " Error: Illegal immediate value; treated as 9999";
                 break;
-            case 'E':
-                if (!use_list->Has(operand)) {
-                    // Rule 6: If an external address is too large to
-                    // reference an entry in the use list, print an error
-                    // message and treat the address as immediate.
-                    err = ("Error: External address exceeds length of "
-                        "uselist; treated as immediate");
-                    break;
-                }
-                // Map appress using external symbols.
-                auto& extern_symbol = use_list->Get(operand);
-                operand = symbol_table->Value(
-                    extern_symbol->symbol(), true);
-                if (operand == -1) {
-                    // Rule 3: Symbol value doesn't exist.
-                    operand = kInvalidInstructionCodeUnderflow;
-                    err = ("Error: " + extern_symbol->symbol() +
-                        " is not defined; zero used");
-                }
-                extern_symbol->used(true);
-                instruction = kMaxOperand * op_code + operand;
+            case RELOCATION_RELATIVE_OVERFLOW:
+                out_ << " Error: Relative address exceeds module size; "
+                    "zero used";
+                break;
+            case RELOCATION_EXTERNAL_OVERFLOW:
+                out_ << " Error: External address exceeds length of "
+                    "uselist; treated as immediate";
+                break;
+            case RELOCATION_UNDEFINED_SYMBOL:
+                out_ << " Error: "
+                     << use_list->Get(
+                            instructions.codes[i] % kMaxOperand).symbol()
+                     << " is not defined; zero used";
                 break;
-            }
         }
-        // Print instruction on console.
-        int instruction_index =
-            context->module_index() + context->instruction_index();
-        cout << std::setfill('0') << std::setw(3) << instruction_index;
-        cout << ": " << std::setfill('0') << std::setw(4) << instruction;
-        if (!err.empty()) {
-            cout << " " << err;
+        out_ << endl;
+        // Rule 4 and 7 need the symbols the E instructions refer to.
+        if constexpr (Policy::kWarnings) {
+            if (instructions.types[i] == 'E' &&
+                (errors_[i] == RELOCATION_OK ||
+                 errors_[i] == RELOCATION_UNDEFINED_SYMBOL)) {
+                auto& extern_symbol =
+                    use_list->Get(instructions.codes[i] % kMaxOperand);
+                symbol_table->Value(extern_symbol.symbol(), true);
+                extern_symbol.used(true);
+            }
         }
-        cout << endl;
     }
 }
 
@@ -913,29 +2312,520 @@ void InstructionGenerator::ProcessToken(
 // list. (Rule 7).
 // It will also resets the use list as call to this marks the beginning
 // of ny module.
-void InstructionGenerator::HandleModuleChange(
+template <typename Policy>
+void InstructionGenerator<Policy>::HandleModuleChange(
         const std::unique_ptr<tokenizer::ParsingContext>& context,
         const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
         const std::unique_ptr<tokenizer::UseList>& use_list) {
+    if constexpr (Policy::kWarnings) {
         // Rule 7 Symbols used.
-    auto unused_symbols = use_list->UnusedSymbols();
-    for (const auto& unused_symbol: unused_symbols) {
-        cout << "Warning: Module " << (context->module_count() - 1)
-             << ": " << unused_symbol
-             << " appeared in the uselist but was not actually used"
-             << endl;
+        auto unused_symbols = use_list->UnusedSymbols();
+        for (const auto& unused_symbol: unused_symbols) {
+            out_ << "Warning: "
+                 << symbol_table->Module(context->module_count() - 1)
+                 << ": " << unused_symbol
+                 << " appeared in the uselist but was not actually used"
+                 << endl;
+        }
     }
     use_list->Reset();
 }
 
-}  // namespace linker
+// Parsed form of a single module of an object file. Used when modules are
+// handled as a whole (e.g. library archives) instead of token by token.
+struct ObjectModule {
+    // <symbol, value relative to the module> in the def list.
+    std::vector<std::pair<base::SymbolKey, int>> definitions;
+    std::vector<base::SymbolKey> uses;  // Symbols in the use list.
+    std::vector<std::pair<char, int>> instructions;  // <type, code> pairs.
+    // Line of the def list count, where the module starts.
+    int line = 0;
+    // Line and offset of the instruction count, for error messages.
+    int instruction_count_line = 0;
+    int instruction_count_offset = 0;
+
+    // Writes the module back in the object file format.
+    void Write(std::ostream& out) const;
+};
 
+void ObjectModule::Write(std::ostream& out) const {
+    out << definitions.size();
+    for (const auto& definition : definitions) {
+        out << " " << definition.first << " " << definition.second;
+    }
+    out << endl << uses.size();
+    for (const auto& use : uses) {
+        out << " " << use;
+    }
+    out << endl << instructions.size();
+    for (const auto& instruction : instructions) {
+        out << " " << instruction.first << " " << instruction.second;
+    }
+    out << endl;
+}
 
+// Collects every module of the input as an ObjectModule.
+class ModuleCollector : public tokenizer::TokenProcessor {
+public:
+    explicit ModuleCollector(std::vector<ObjectModule>* modules)
+        : modules_(modules) {}
 
-int main(int argc, char* argv[]) {
-    // Stores filename. (Will throw exception if commandline not provided.)
-    string filename(argv[1]);
+    void ProcessToken(
+            const base::Token& token,
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list) override;
+    void ProcessInstructions(
+            const tokenizer::InstructionList& instructions,
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list) override {
+        auto& module_instructions = modules_->back().instructions;
+        for (int i = 0; i < instructions.count; i++) {
+            module_instructions.emplace_back(
+                instructions.types[i], instructions.codes[i]);
+        }
+    }
+    void Stop(
+            const std::unique_ptr<tokenizer::ParsingContext>& context,
+            const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+            const std::unique_ptr<tokenizer::UseList>& use_list) override {}
+private:
+    std::vector<ObjectModule>* modules_;  // Not owned.
+};
+
+void ModuleCollector::ProcessToken(
+        const base::Token& token,
+        const std::unique_ptr<tokenizer::ParsingContext>& context,
+        const std::unique_ptr<tokenizer::SymbolTable>& symbol_table,
+        const std::unique_ptr<tokenizer::UseList>& use_list) {
+    int value;
+    base::SymbolKey symbol;
+    switch (context->current_state()) {
+        case tokenizer::STATE_MODULE_START:
+            modules_->emplace_back();
+            modules_->back().line = token.line_num();
+            break;
+        case tokenizer::STATE_READ_DEFINITION_VALUE:
+            token.ReadAsInt(&value);  // Processor won't see syntax error.
+            modules_->back().definitions.emplace_back(
+                context->last_symbol(), value);
+            break;
+        case tokenizer::STATE_USE_LIST_READ:
+            token.ReadAsSymbol(&symbol);
+            modules_->back().uses.push_back(symbol);
+            break;
+        case tokenizer::STATE_INSTRUCTION_LIST_START:
+            modules_->back().instruction_count_line = token.line_num();
+            modules_->back().instruction_count_offset = token.position();
+            break;
+        default:
+            break;
+    }
+}
+
+// Parses all the modules in "input". Throws runtime_error with the parse
+// error message if the input isn't a valid object file.
+std::vector<ObjectModule> CollectModules(
+        std::unique_ptr<std::istream> input, base::LinkArena* arena,
+        int instruction_limit = kMaxUseInstructionsSize) {
+    std::vector<ObjectModule> modules;
+    tokenizer::Tokenizer collector(
+        std::move(input), make_unique<ModuleCollector>(&modules),
+        make_unique<tokenizer::SymbolTable>(arena->resource()));
+    collector.context()->instruction_limit(instruction_limit);
+    collector.TokenizeFile();
+    return modules;
+}
+
+// Dead module elimination. Returns the indexes of the modules reachable
+// from the "roots" module indexes through use lists, in their original
+// order. A used symbol refers to the module with its first definition, as
+// in the symbol table. Dropped modules take no address space so the kept
+// modules are laid out back to back.
+std::vector<int> ReachableModules(
+        const std::vector<ObjectModule>& modules, const std::vector<int>& roots) {
+    std::unordered_map<base::SymbolKey, int, base::SymbolKeyHash> definitions;
+    for (size_t i = 0; i < modules.size(); i++) {
+        for (const auto& definition : modules[i].definitions)
+            definitions.emplace(definition.first, i);
+    }
+    std::vector<bool> reachable(modules.size(), false);
+    std::vector<int> pending;
+    for (int root : roots) {
+        if (root >= 0 && root < static_cast<int>(modules.size()) &&
+            !reachable[root]) {
+            reachable[root] = true;
+            pending.push_back(root);
+        }
+    }
+    while (!pending.empty()) {
+        int module = pending.back();
+        pending.pop_back();
+        for (const auto& use : modules[module].uses) {
+            auto it = definitions.find(use);
+            if (it != definitions.end() && !reachable[it->second]) {
+                reachable[it->second] = true;
+                pending.push_back(it->second);
+            }
+        }
+    }
+    std::vector<int> kept;
+    for (size_t i = 0; i < modules.size(); i++) {
+        if (reachable[i])
+            kept.push_back(i);
+    }
+    return kept;
+}
+
+// Object file read into memory by LoadObjectFiles.
+struct LoadedObject {
+    std::string filename;
+    std::string text;
+    std::vector<ObjectModule> modules;
+    // Read or parse error, empty if the file is valid.
+    std::string error;
+};
+
+// Reads the object files and parses them, several files at a time. Each
+// file must hold whole modules. The machine size limit applies to the
+// whole program and is checked by FirstLoadError. Every file gets its own
+// counters in "stats" (may be null).
+std::vector<LoadedObject> LoadObjectFiles(
+        const std::vector<std::string>& filenames,
+        std::vector<base::InflateStats>* stats) {
+    std::vector<LoadedObject> objects(filenames.size());
+    if (stats)
+        stats->resize(filenames.size());
+    std::atomic<size_t> next{0};
+    auto load = [&]() {
+        base::LinkArena arena;
+        for (size_t i = next++; i < filenames.size(); i = next++) {
+            LoadedObject& object = objects[i];
+            object.filename = filenames[i];
+            base::InputFile input(filenames[i], stats ? &(*stats)[i] : nullptr);
+            try {
+                auto stream = input.Open();
+                if (!*stream)
+                    throw runtime_error("Error: can't read the file");
+                object.text = base::ReadStream(*stream);
+                object.modules = CollectModules(
+                    make_unique<base::MemoryIstream>(object.text), &arena,
+                    std::numeric_limits<int>::max());
+            } catch (const runtime_error& e) {
+                object.error = e.what();
+            }
+            arena.Reset();
+        }
+    };
+    size_t thread_count = std::min<size_t>(
+        filenames.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(load);
+    load();
+    for (auto& thread : threads)
+        thread.join();
+    return objects;
+}
+
+// Adds the definitions of the objects to "definitions", one thread per
+// object at a time, with module numbers and addresses of the objects laid
+// out in order. The instruction count of every module is appended to
+// "module_sizes".
+void CollectDefinitions(const std::vector<LoadedObject>& objects,
+                        tokenizer::ConcurrentSymbolTable* definitions,
+                        std::vector<int>* module_sizes) {
+    // Number and address of the first module of every object.
+    std::vector<std::pair<int, int>> firsts;
+    int module = 1;
+    int module_index = 0;
+    for (const auto& object : objects) {
+        firsts.emplace_back(module, module_index);
+        for (const auto& object_module : object.modules) {
+            module_sizes->push_back(object_module.instructions.size());
+            module_index += object_module.instructions.size();
+            module++;
+        }
+    }
+    std::atomic<size_t> next{0};
+    auto collect = [&]() {
+        for (size_t i = next++; i < objects.size(); i = next++) {
+            int module = firsts[i].first;
+            int module_index = firsts[i].second;
+            for (const auto& object_module : objects[i].modules) {
+                for (size_t position = 0;
+                     position < object_module.definitions.size(); position++) {
+                    const auto& definition = object_module.definitions[position];
+                    definitions->AddSymbol(
+                        definition.first, definition.second + module_index,
+                        module, position);
+                }
+                module_index += object_module.instructions.size();
+                module++;
+            }
+        }
+    };
+    size_t thread_count = std::min<size_t>(
+        objects.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(collect);
+    collect();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+// Checks that "modules", laid out in order, fit in the machine. The
+// positions of a module are in the file named by its entry of "sources"
+// (empty for no name). Returns the TOO_MANY_INSTR parse error of the first
+// module that doesn't fit, prefixed by its source, or an empty string.
+std::string CheckMemorySize(const std::vector<const ObjectModule*>& modules,
+                            const std::vector<std::string>& sources) {
+    int module_index = 0;
+    for (size_t i = 0; i < modules.size(); i++) {
+        module_index += modules[i]->instructions.size();
+        if (module_index > kMaxUseInstructionsSize) {
+            base::Token token(modules[i]->instruction_count_line,
+                              modules[i]->instruction_count_offset, "");
+            token.err(ERROR_TOO_MANY_INSTR);
+            std::string error = base::ErrorMessageForToken(token);
+            return sources[i].empty() ? error : sources[i] + ": " + error;
+        }
+    }
+    return "";
+}
+
+// Returns the first error of the objects laid out in order, as a link of
+// the concatenated files would find it, prefixed by the file name: the
+// parse error of a file or the TOO_MANY_INSTR error of the first module
+// that doesn't fit in the machine, whichever comes first. Empty if there
+// is none.
+std::string FirstLoadError(const std::vector<LoadedObject>& objects) {
+    int module_index = 0;
+    for (const auto& object : objects) {
+        int size = 0;
+        for (const auto& module : object.modules)
+            size += module.instructions.size();
+        if (object.error.empty() &&
+            module_index + size <= kMaxUseInstructionsSize) {
+            module_index += size;
+            continue;
+        }
+        // Parse the file again with the space left in the machine so its
+        // errors are found in file order, the machine size included.
+        base::LinkArena arena;
+        try {
+            CollectModules(make_unique<base::MemoryIstream>(object.text),
+                           &arena, kMaxUseInstructionsSize - module_index);
+        } catch (const runtime_error& e) {
+            return object.filename + ": " + e.what();
+        }
+        // The text couldn't be read (e.g. truncated compressed input).
+        return object.filename + ": " + object.error;
+    }
+    return "";
+}
+
+// Partial (relocatable) link. Merges "modules" into one module that links
+// like the modules it replaces when they are kept together:
+//  - the def list has the first definition of every symbol, relative to
+//    the merged module,
+//  - E instructions refer to the merged use list, which has every symbol
+//    used by the modules. Symbols the modules define stay external too,
+//    so the final link binds them to the first definition in the program
+//    like it would the original modules, wherever the merged module is,
+//  - R instructions are rebased on the merged module.
+// The errors and warnings of rules 2, 5, 6, 7 and 9 are reported to
+// "diagnostics" and the fixed instruction or value goes to the output;
+// rules 8, 10 and 11 are left to the final link. Throws runtime_error if
+// the merged lists don't fit the limits of a module.
+ObjectModule PartialLink(const std::vector<ObjectModule>& modules,
+                         std::ostream& diagnostics) {
+    ObjectModule merged;
+    std::vector<int> bases;
+    int size = 0;
+    for (const auto& module : modules) {
+        bases.push_back(size);
+        size += module.instructions.size();
+    }
+    // Definitions, first one wins (Rule 2) and out of module values are
+    // moved to the module start (Rule 5).
+    std::unordered_set<base::SymbolKey, base::SymbolKeyHash> defined;
+    for (size_t i = 0; i < modules.size(); i++) {
+        int module_size = modules[i].instructions.size();
+        for (const auto& definition : modules[i].definitions) {
+            if (defined.count(definition.first)) {
+                diagnostics << "Error: " << definition.first << " is multiple "
+                            << "times defined; first value used" << endl;
+                continue;
+            }
+            int value = definition.second;
+            if (value >= module_size) {
+                diagnostics << "Warning: Module " << i + 1 << ": "
+                            << definition.first << " too big " << value
+                            << " (max=" << module_size - 1
+                            << ") assume zero relative" << endl;
+                value = 0;
+            }
+            if (bases[i] + value >= size) {
+                // Only empty modules at the end get here.
+                diagnostics << "Warning: " << definition.first << " is at "
+                            << "the end of the merged module, the final link "
+                            << "moves it to the module start" << endl;
+            }
+            defined.insert(definition.first);
+            merged.definitions.emplace_back(
+                definition.first, bases[i] + value);
+        }
+    }
+    std::unordered_map<base::SymbolKey, int, base::SymbolKeyHash> uses;
+    for (size_t i = 0; i < modules.size(); i++) {
+        const auto& module = modules[i];
+        int module_size = module.instructions.size();
+        std::vector<bool> used(module.uses.size());
+        for (const auto& instruction : module.instructions) {
+            char type = instruction.first;
+            int code = instruction.second;
+            int op_code = code / kMaxOperand;
+            int operand = code % kMaxOperand;
+            int address = merged.instructions.size();
+            if (op_code >= kMaxOpCode && type != 'I') {
+                // Rule 11, the final link replaces the instruction.
+            } else if (type == 'R') {
+                if (operand >= module_size) {
+                    diagnostics << std::setfill('0') << std::setw(3)
+                                << address << ": Error: Relative address "
+                                << "exceeds module size; zero used" << endl;
+                    operand = 0;
+                }
+                code = kMaxOperand * op_code + bases[i] + operand;
+            } else if (type == 'E') {
+                if (operand < 0 ||
+                    operand >= static_cast<int>(module.uses.size())) {
+                    // Rule 6, the address stays as it is.
+                    diagnostics << std::setfill('0') << std::setw(3)
+                                << address << ": Error: External address "
+                                << "exceeds length of uselist; treated as "
+                                << "immediate" << endl;
+                    type = 'I';
+                } else {
+                    const base::SymbolKey& symbol = module.uses[operand];
+                    used[operand] = true;
+                    auto use = uses.emplace(symbol, merged.uses.size());
+                    if (use.second)
+                        merged.uses.push_back(symbol);
+                    code = kMaxOperand * op_code + use.first->second;
+                }
+            }
+            merged.instructions.emplace_back(type, code);
+        }
+        // Rule 7.
+        for (size_t j = 0; j < module.uses.size(); j++) {
+            if (!used[j]) {
+                diagnostics << "Warning: Module " << i + 1 << ": "
+                            << module.uses[j] << " appeared in the uselist "
+                            << "but was not actually used" << endl;
+            }
+        }
+    }
+    if (merged.definitions.size() > kMaxDefinitionListSize) {
+        throw runtime_error(
+            "Error: " + std::to_string(merged.definitions.size()) +
+            " symbols defined, a module can define " +
+            std::to_string(kMaxDefinitionListSize));
+    }
+    if (merged.uses.size() > kMaxUseListSize) {
+        throw runtime_error(
+            "Error: " + std::to_string(merged.uses.size()) +
+            " symbols used, a module can use " +
+            std::to_string(kMaxUseListSize));
+    }
+    return merged;
+}
+
+// Partial links the object files in "inputs" into a single module written
+// to "filename". Returns false and prints the error on failure.
+bool WritePartialLink(const std::string& filename,
+                      const std::vector<std::string>& inputs) {
+    auto objects = LoadObjectFiles(inputs, nullptr);
+    std::string error = FirstLoadError(objects);
+    if (!error.empty()) {
+        base::PrintError(cerr, error);
+        return false;
+    }
+    std::vector<ObjectModule> modules;
+    for (const auto& object : objects) {
+        modules.insert(modules.end(), object.modules.begin(),
+                       object.modules.end());
+    }
+    ObjectModule merged;
+    try {
+        merged = PartialLink(modules, cerr);
+    } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+    std::ofstream out(filename);
+    merged.Write(out);
+    return static_cast<bool>(out);
+}
+
+// Opens the object file. Each pass reads the input from the beginning, so
+// this is invoked once per pass.
+typedef std::function<std::unique_ptr<std::istream>()> InputOpener;
+
+// Settings of a single link.
+struct LinkOptions {
+    // The link throws LinkTimeout once this is passed.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    RuleMode rule_mode = RULES_FULL;
+    // Source file of every module, see SymbolTable::module_sources.
+    const std::vector<std::string>* module_sources = nullptr;
+    // Definitions collected while the input was loaded (see
+    // CollectDefinitions) and the instruction count of every module. When
+    // set, pass 1 builds the symbol table from them instead of reading the
+    // input.
+    const tokenizer::ConcurrentSymbolTable* definitions = nullptr;
+    const std::vector<int>* module_sizes = nullptr;
+    // Filled with the module ranges and symbol addresses of the program if
+    // not null. Incomplete if the link fails.
+    SymbolIndex* symbol_index = nullptr;
+};
 
+// Pass 1 over the definitions of LinkOptions: freezes them into the symbol
+// table and checks rule 5 module by module, as SymbolTableGenerator does.
+template <typename Policy>
+std::unique_ptr<tokenizer::SymbolTable> FreezeSymbolTable(
+        const LinkOptions& options, base::LinkArena* arena,
+        std::ostream& out) {
+    auto symbol_table =
+        make_unique<tokenizer::SymbolTable>(arena->resource());
+    symbol_table->module_sources(options.module_sources);
+    options.definitions->Freeze(symbol_table.get());
+    if constexpr (Policy::kVerifyInput) {
+        int module_index = 0;
+        for (size_t i = 0; i < options.module_sizes->size(); i++) {
+            int module_size = (*options.module_sizes)[i];
+            module_index += module_size;
+            symbol_table->VerifySymbol(
+                i + 1, module_size, module_index, out, Policy::kWarnings);
+        }
+    }
+    return symbol_table;
+}
+
+// Links the object file returned by "open" and writes the linker output
+// (symbol table, memory map, warnings and syntax errors) to "out".
+// All the link state is allocated from "arena"; the caller may Reset() it
+// once this returns. Returns false if the input had a syntax error. Throws
+// LinkTimeout if the link runs past the deadline in "options". "Policy"
+// selects the rules checked, see FullChecking.
+template <typename Policy>
+bool LinkWithRules(
+        const InputOpener& open, std::ostream& out, base::LinkArena* arena,
+        const LinkOptions& options) {
     // ==================== PASS 1 ==================================
 
     // Tokenizer class abstracts the parsing logic and provide a
@@ -949,32 +2839,43 @@ int main(int argc, char* argv[]) {
     // Tokenizer class accepts an object of SymbolTable that will be provided
     // to TokenProcessor::ProcessToken. Tokenizer during pass1 is created
     // with a new SymbolTable, whose ownership is transferred to the 
-    // pass2 tokenizer.
-    tokenizer::Tokenizer pass1(
-        filename, make_unique<linker::SymbolTableGenerator>(),
-        make_unique<tokenizer::SymbolTable>());
-    try {
-        // Internally calls the SymbolTableGenerator logic while processing
-        // tokens for the first pass. The ProcessToken in SymbolTableGenerator
-        // mainly process tokens from the Def list in each module and
-        // Stores symbol = value in symbol table. It also handles error
-        // rule 2 and warning rule 5. Also any syntax error will be thrown
-        // during this pass. Syntax errors are handled from ParsingContext
-        // object owned directly by the tokenizer.
-        pass1.TokenizeFile();
-    } catch (const runtime_error& e) {
-        // Catch syntax errors and terminate.
-        cout << e.what() << endl;
-        return 0;
+    // pass2 tokenizer. Definitions collected while loading the input are
+    // frozen into the SymbolTable instead.
+    std::unique_ptr<tokenizer::SymbolTable> symbol_table;
+    if (options.definitions != nullptr) {
+        symbol_table = FreezeSymbolTable<Policy>(options, arena, out);
+    } else {
+        tokenizer::Tokenizer pass1(
+            open(), make_unique<SymbolTableGenerator<Policy>>(out),
+            make_unique<tokenizer::SymbolTable>(arena->resource()));
+        pass1.deadline(options.deadline);
+        pass1.symbol_table()->module_sources(options.module_sources);
+        try {
+            // Internally calls the SymbolTableGenerator logic while processing
+            // tokens for the first pass. The ProcessToken in SymbolTableGenerator
+            // mainly process tokens from the Def list in each module and
+            // Stores symbol = value in symbol table. It also handles error
+            // rule 2 and warning rule 5. Also any syntax error will be thrown
+            // during this pass. Syntax errors are handled from ParsingContext
+            // object owned directly by the tokenizer.
+            pass1.TokenizeFile();
+        } catch (const tokenizer::LinkTimeout& e) {
+            throw;
+        } catch (const runtime_error& e) {
+            // Catch syntax errors and terminate.
+            out << e.what() << endl;
+            return false;
+        }
+        symbol_table = std::move(pass1.symbol_table());
     }
 
     // Prints SymbolTable portion of the linker output. (Including warnings)
-    pass1.symbol_table()->Print();
+    symbol_table->Print(out);
 
     // ====================== PASS 2 =================================
 
     // Start the Memory Map section of the linker output.
-    cout << "Memory Map" << endl;
+    out << "Memory Map" << endl;
     // A new Tokenizer object is created which takes the ownership of
     // SymbolTable generated from pass1. We are creating a new object instead of
     // reseting the tokenizer for pass1 to
@@ -984,8 +2885,10 @@ int main(int argc, char* argv[]) {
     // The TokenProcessor for this pass is InstructionGenerator which
     // handles parsing the RIAE instructions and generating the memory map.
     tokenizer::Tokenizer pass2(
-        filename, make_unique<linker::InstructionGenerator>(),
-        std::move(pass1.symbol_table()));
+        open(),
+        make_unique<InstructionGenerator<Policy>>(out, options.symbol_index),
+        std::move(symbol_table));
+    pass2.deadline(options.deadline);
     try {
         // Internally calls the InstructionGenerator logic while processing
         // tokens for the second pass. The ProcessToken in InstructionGenerator
@@ -999,10 +2902,1014 @@ int main(int argc, char* argv[]) {
         // The parsing logic in pass2 is identical to pass1 as the Tokenizer
         // can't distinguish if it is running pass1 or pass2.
         pass2.TokenizeFile();
+    } catch (const tokenizer::LinkTimeout& e) {
+        throw;
     } catch (const runtime_error& e) {
-        cout << e.what() << endl;  // No error expected here.
+        out << e.what() << endl;  // No error expected here.
+        return false;
+    }
+    return true;
+}
+
+// Links with the rule policy picked at run time. See LinkWithRules.
+bool Link(const InputOpener& open, std::ostream& out, base::LinkArena* arena,
+          const LinkOptions& options) {
+    switch (options.rule_mode) {
+        case RULES_NO_WARNINGS:
+            return LinkWithRules<NoWarnings>(open, out, arena, options);
+        case RULES_TRUSTED_INPUT:
+            return LinkWithRules<TrustedInput>(open, out, arena, options);
+        default:
+            return LinkWithRules<FullChecking>(open, out, arena, options);
+    }
+}
+
+}  // namespace linker
+
+namespace archive {
+
+// Library archive holding modules and an index from defined symbol to the
+// module defining it, so a link loads only the modules it needs.
+//
+// Layout (text, offsets are bytes from the start of the file):
+//   !<linkarch>
+//   <# modules>
+//   <offset> <length>             one line per module, fixed width
+//   <# symbols>
+//   <symbol> <module index>       one line per defined symbol
+//   <modules in object file format>
+static const char* kArchiveMagic = "!<linkarch>";
+static const int kOffsetWidth = 12;
+
+class Archive {
+public:
+    // Reads the index of the archive. Throws runtime_error if the file
+    // isn't an archive or its index is corrupt.
+    explicit Archive(const std::string& filename);
+
+    // Index of the module defining symbol, -1 if none does.
+    int Find(const base::SymbolKey& symbol) const;
+
+    // Text of the module at index, read from disk on demand. Throws
+    // runtime_error if the archive is cut short.
+    std::string ReadModule(int index);
+
+    const std::string& filename() const { return filename_; }
+
+private:
+    const std::string filename_;
+    std::ifstream stream_;
+    std::vector<std::pair<long, long>> modules_;  // <offset, length>
+    std::unordered_map<base::SymbolKey, int, base::SymbolKeyHash> index_;
+};
+
+Archive::Archive(const std::string& filename)
+    : filename_(filename), stream_(filename, ios::binary) {
+    std::string magic;
+    size_t module_count, symbol_count;
+    if (!getline(stream_, magic) || magic != kArchiveMagic ||
+        !(stream_ >> module_count)) {
+        throw runtime_error("Error: " + filename + " is not an archive");
+    }
+    long offset, length;
+    for (size_t i = 0; i < module_count && stream_ >> offset >> length; i++) {
+        if (offset < 0 || length < 0)
+            stream_.setstate(ios::failbit);
+        modules_.emplace_back(offset, length);
+    }
+    stream_ >> symbol_count;
+    std::string symbol;
+    int module;
+    for (size_t i = 0; i < symbol_count && stream_ >> symbol >> module; i++) {
+        if (symbol.length() > kMaxSymbolLength || module < 0 ||
+            static_cast<size_t>(module) >= modules_.size())
+            stream_.setstate(ios::failbit);
+        index_.emplace(base::SymbolKey(symbol.substr(0, kMaxSymbolLength)),
+                       module);
+    }
+    if (!stream_) {
+        throw runtime_error("Error: " + filename + " has a corrupt index");
+    }
+}
+
+int Archive::Find(const base::SymbolKey& symbol) const {
+    auto it = index_.find(symbol);
+    return it == index_.end() ? -1 : it->second;
+}
+
+std::string Archive::ReadModule(int index) {
+    std::string text(modules_[index].second, '\0');
+    stream_.clear();
+    stream_.seekg(modules_[index].first);
+    stream_.read(&text[0], text.length());
+    if (!stream_) {
+        throw runtime_error("Error: " + filename_ + " is truncated");
+    }
+    return text;
+}
+
+// Writes every module of the object files in "inputs" into a new archive.
+// A symbol defined by several modules is indexed to the first one. Returns
+// false and prints the parse error if an input isn't a valid object file.
+bool WriteArchive(const std::string& filename,
+                  const std::vector<std::string>& inputs) {
+    std::vector<std::string> modules;
+    std::vector<std::pair<base::SymbolKey, int>> symbols;
+    std::unordered_set<base::SymbolKey, base::SymbolKeyHash> indexed;
+    base::LinkArena arena;
+    for (const auto& input : inputs) {
+        std::vector<linker::ObjectModule> parsed;
+        try {
+            base::InputFile file(input);
+            auto stream = file.Open();
+            if (!*stream)
+                throw runtime_error("Error: can't read the file");
+            parsed = linker::CollectModules(std::move(stream), &arena);
+        } catch (const runtime_error& e) {
+            base::PrintError(cerr, input + ": " + e.what());
+            return false;
+        }
+        for (const auto& module : parsed) {
+            for (const auto& definition : module.definitions) {
+                if (indexed.insert(definition.first).second)
+                    symbols.emplace_back(definition.first, modules.size());
+            }
+            std::ostringstream text;
+            module.Write(text);
+            modules.push_back(text.str());
+        }
+    }
+
+    // Header size is known up front as the offsets are fixed width.
+    std::ostringstream index;
+    index << symbols.size() << endl;
+    for (const auto& symbol : symbols) {
+        index << symbol.first << " " << symbol.second << endl;
+    }
+    long offset = strlen(kArchiveMagic) + 1 +
+        std::to_string(modules.size()).length() + 1 +
+        modules.size() * (2 * kOffsetWidth + 2) + index.str().length();
+
+    std::ofstream out(filename, ios::binary);
+    out << kArchiveMagic << endl << modules.size() << endl;
+    for (const auto& module : modules) {
+        out << std::setfill('0') << std::setw(kOffsetWidth) << offset << " "
+            << std::setw(kOffsetWidth) << module.length() << endl;
+        offset += module.length();
+    }
+    out << index.str();
+    for (const auto& module : modules) {
+        out << module;
+    }
+    return static_cast<bool>(out);
+}
+
+// Returns "object_text" followed by the archive modules needed to resolve
+// the symbols of its use lists. Loaded modules can pull in more modules
+// through their own use lists; this repeats until nothing new is needed.
+// Only the archive index and the loaded modules are read. Modules are laid
+// out by archive order on the command line and then by position in the
+// archive, so the output doesn't depend on the order of resolution. The
+// archive of every loaded module is appended to "module_sources" and its
+// number in the archive (counting from 1) to "archive_modules" (may be
+// null). Throws runtime_error if the object text or a loaded module has a
+// syntax error, or an archive can't be read.
+std::string ResolveArchives(
+        const std::string& object_text,
+        std::vector<std::unique_ptr<Archive>>& archives,
+        base::LinkArena* arena, std::vector<std::string>* module_sources,
+        std::vector<int>* archive_modules = nullptr) {
+    std::unordered_set<base::SymbolKey, base::SymbolKeyHash> defined;
+    std::queue<base::SymbolKey> unresolved;
+    auto add_modules = [&](const std::vector<linker::ObjectModule>& modules) {
+        for (const auto& module : modules)
+            for (const auto& definition : module.definitions)
+                defined.insert(definition.first);
+        for (const auto& module : modules)
+            for (const auto& use : module.uses)
+                if (defined.find(use) == defined.end())
+                    unresolved.push(use);
+    };
+    add_modules(linker::CollectModules(
+        make_unique<base::MemoryIstream>(object_text), arena));
+
+    // <archive index, module index> -> module text.
+    std::map<std::pair<size_t, int>, std::string> loaded;
+    while (!unresolved.empty()) {
+        base::SymbolKey symbol = unresolved.front();
+        unresolved.pop();
+        if (defined.find(symbol) != defined.end())
+            continue;
+        for (size_t i = 0; i < archives.size(); i++) {
+            int module = archives[i]->Find(symbol);
+            if (module < 0)
+                continue;
+            auto key = make_pair(i, module);
+            if (loaded.find(key) == loaded.end()) {
+                std::string text = archives[i]->ReadModule(module);
+                try {
+                    add_modules(linker::CollectModules(
+                        make_unique<base::MemoryIstream>(text), arena));
+                } catch (const runtime_error& e) {
+                    throw runtime_error(
+                        archives[i]->filename() + ": module " +
+                        std::to_string(module + 1) + ": " + e.what());
+                }
+                loaded.emplace(key, std::move(text));
+            }
+            break;
+        }
+    }
+
+    std::string linked_text = object_text;
+    if (!linked_text.empty() && linked_text.back() != '\n')
+        linked_text += '\n';
+    for (const auto& module : loaded) {
+        linked_text += module.second;
+        module_sources->push_back(archives[module.first.first]->filename());
+        if (archive_modules)
+            archive_modules->push_back(module.first.second + 1);
+    }
+    return linked_text;
+}
+
+}  // namespace archive
+
+namespace server {
+
+// Wire format of the link server. Every connection carries one request.
+//
+// Request: "<VERB> <length>\n" followed by <length> bytes of payload.
+//   PATH  - Payload is the path of an object file readable by the server.
+//   DATA  - Payload is the content of the object file itself.
+//   STATS - No payload. Returns the server counters.
+// Response: Zero or more "C <length>\n<bytes>" chunks with the linker
+//   output as it is produced, followed by "E <status>\n" where status is
+//   one of OK, SYNTAX_ERROR, TIMEOUT, BUSY or BAD_REQUEST.
+static const int kChunkSize = 4096;
+static const int kMaxPendingJobs = 256;
+static const size_t kMaxPayloadSize = 64 << 20;
+
+struct ServerOptions {
+    std::string socket_path;
+    int max_jobs = 4;  // Links running at the same time.
+    int timeout_ms = 0;  // Per job timeout. 0 means no timeout.
+};
+
+// Counters reported by the STATS request.
+struct ServerStats {
+    std::atomic<long> accepted{0};
+    std::atomic<long> completed{0};
+    std::atomic<long> syntax_errors{0};
+    std::atomic<long> timed_out{0};
+    std::atomic<long> rejected{0};
+    std::atomic<long> active{0};
+    std::atomic<long> link_time_us{0};
+    std::atomic<size_t> arena_peak_bytes{0};  // Largest link seen.
+
+    void Write(std::ostream& out) const {
+        out << "jobs_accepted " << accepted << endl
+            << "jobs_completed " << completed << endl
+            << "jobs_syntax_error " << syntax_errors << endl
+            << "jobs_timed_out " << timed_out << endl
+            << "jobs_rejected " << rejected << endl
+            << "jobs_active " << active << endl
+            << "link_time_us " << link_time_us << endl
+            << "arena_peak_bytes " << arena_peak_bytes << endl;
+    }
+};
+
+bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Waits until "fd" has data to read. False once "deadline" is passed.
+bool WaitReadable(int fd, std::chrono::steady_clock::time_point deadline) {
+    if (deadline == std::chrono::steady_clock::time_point::max())
+        return true;
+    while (true) {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0)
+            return false;
+        pollfd p = {fd, POLLIN, 0};
+        int ready = poll(&p, 1, static_cast<int>(
+            std::min<long long>(left, std::numeric_limits<int>::max())));
+        if (ready < 0 && errno == EINTR)
+            continue;
+        // A hang up or error is readable too; read() then reports it.
+        if (ready != 0)
+            return ready > 0;
+    }
+}
+
+// Reads exactly "size" bytes. Fails if the peer closes the connection or
+// the data doesn't arrive by "deadline".
+bool ReadAll(int fd, char* data, size_t size,
+             std::chrono::steady_clock::time_point deadline =
+                 std::chrono::steady_clock::time_point::max()) {
+    while (size > 0) {
+        if (!WaitReadable(fd, deadline))
+            return false;
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reads a "<word> <number>\n" frame header.
+bool ReadHeader(int fd, std::string* word, size_t* length,
+                std::chrono::steady_clock::time_point deadline) {
+    std::string line;
+    char c;
+    while (ReadAll(fd, &c, 1, deadline)) {
+        if (c == '\n') {
+            std::istringstream header(line);
+            return static_cast<bool>(header >> *word >> *length);
+        }
+        if (line.length() > 64)
+            return false;
+        line.push_back(c);
+    }
+    return false;
+}
+
+bool WriteStatus(int fd, const std::string& status) {
+    std::string frame = "E " + status + "\n";
+    return WriteAll(fd, frame.data(), frame.length());
+}
+
+// Stream buffer framing everything written into it as response chunks.
+// Output is sent as soon as a chunk fills up so that clients see the
+// memory map while the link is still running.
+class ChunkedSocketBuf : public std::streambuf {
+public:
+    explicit ChunkedSocketBuf(int fd) : fd_(fd), ok_(true) {
+        setp(buffer_, buffer_ + kChunkSize);
+    }
+    ~ChunkedSocketBuf() { Flush(); }
+
+    // False once the peer went away.
+    bool ok() const { return ok_; }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!Flush())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // The linker flushes after every line (endl). Only full chunks are
+    // sent to keep the number of frames and syscalls down; the rest goes
+    // out when the buffer is destroyed.
+    int sync() override { return ok_ ? 0 : -1; }
+
+private:
+    bool Flush() {
+        size_t size = pptr() - pbase();
+        if (size == 0 || !ok_) {
+            setp(buffer_, buffer_ + kChunkSize);
+            return ok_;
+        }
+        std::string header = "C " + std::to_string(size) + "\n";
+        ok_ = WriteAll(fd_, header.data(), header.length()) &&
+              WriteAll(fd_, buffer_, size);
+        setp(buffer_, buffer_ + kChunkSize);
+        return ok_;
+    }
+
+    int fd_;
+    bool ok_;
+    char buffer_[kChunkSize];
+};
+
+// Accepts link requests on a Unix domain socket and runs them on a fixed
+// pool of worker threads. Workers live for the lifetime of the server so
+// their per thread buffers stay warm between jobs.
+class LinkServer {
+public:
+    explicit LinkServer(const ServerOptions& options) : options_(options) {}
+
+    // Serves requests until the listening socket fails. Returns the exit
+    // code of the process.
+    int Run();
+
+private:
+    void WorkerLoop();
+    void HandleConnection(int fd);
+    // Answers a request that couldn't be read completely.
+    void HandleBadRequest(int fd,
+                          std::chrono::steady_clock::time_point deadline);
+    void HandleStats(int fd);
+    void HandleLink(int fd, const std::string& verb,
+                    const std::string& payload,
+                    std::chrono::steady_clock::time_point deadline);
+
+    const ServerOptions options_;
+    ServerStats stats_;
+    std::mutex mutex_;
+    std::condition_variable pending_cv_;
+    std::queue<int> pending_;  // Accepted connections waiting for a worker.
+};
+
+int LinkServer::Run() {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        cerr << "socket: " << strerror(errno) << endl;
+        return 1;
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (options_.socket_path.length() >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << options_.socket_path << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, options_.socket_path.c_str());
+    unlink(options_.socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || listen(listen_fd, SOMAXCONN) < 0) {
+        cerr << "bind/listen " << options_.socket_path << ": "
+             << strerror(errno) << endl;
+        close(listen_fd);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<thread> workers;
+    for (int i = 0; i < options_.max_jobs; i++) {
+        workers.emplace_back(&LinkServer::WorkerLoop, this);
+    }
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            cerr << "accept: " << strerror(errno) << endl;
+            break;
+        }
+        unique_lock<mutex> lock(mutex_);
+        if (pending_.size() >= kMaxPendingJobs) {
+            lock.unlock();
+            stats_.rejected++;
+            WriteStatus(fd, "BUSY");
+            close(fd);
+            continue;
+        }
+        pending_.push(fd);
+        lock.unlock();
+        pending_cv_.notify_one();
+    }
+    close(listen_fd);
+    // Workers block forever on the queue; leave them to process exit.
+    for (auto& worker : workers)
+        worker.detach();
+    return 1;
+}
+
+void LinkServer::WorkerLoop() {
+    while (true) {
+        unique_lock<mutex> lock(mutex_);
+        pending_cv_.wait(lock, [this] { return !pending_.empty(); });
+        int fd = pending_.front();
+        pending_.pop();
+        lock.unlock();
+        HandleConnection(fd);
+        close(fd);
+    }
+}
+
+void LinkServer::HandleConnection(int fd) {
+    // The job timeout covers reading the request and sending the response
+    // too, so idle or stalled clients can't hold on to a worker.
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (options_.timeout_ms > 0) {
+        deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(options_.timeout_ms);
+        timeval timeout;
+        timeout.tv_sec = options_.timeout_ms / 1000;
+        timeout.tv_usec = (options_.timeout_ms % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    std::string verb;
+    size_t length;
+    if (!ReadHeader(fd, &verb, &length, deadline)) {
+        HandleBadRequest(fd, deadline);
+        return;
+    }
+    if (length > kMaxPayloadSize) {
+        WriteStatus(fd, "BAD_REQUEST");
+        return;
+    }
+    std::string payload(length, '\0');
+    if (!ReadAll(fd, &payload[0], length, deadline)) {
+        HandleBadRequest(fd, deadline);
+        return;
+    }
+    if (verb == "STATS") {
+        HandleStats(fd);
+    } else if (verb == "PATH" || verb == "DATA") {
+        HandleLink(fd, verb, payload, deadline);
+    } else {
+        WriteStatus(fd, "BAD_REQUEST");
+    }
+}
+
+void LinkServer::HandleBadRequest(
+        int fd, std::chrono::steady_clock::time_point deadline) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+        stats_.timed_out++;
+        WriteStatus(fd, "TIMEOUT");
+    } else {
+        WriteStatus(fd, "BAD_REQUEST");
+    }
+}
+
+void LinkServer::HandleStats(int fd) {
+    {
+        ChunkedSocketBuf buf(fd);
+        std::ostream out(&buf);
+        stats_.Write(out);
+    }  // Sends the buffered chunk.
+    WriteStatus(fd, "OK");
+}
+
+void LinkServer::HandleLink(
+        int fd, const std::string& verb, const std::string& payload,
+        std::chrono::steady_clock::time_point deadline) {
+    stats_.accepted++;
+    stats_.active++;
+    auto start = std::chrono::steady_clock::now();
+    linker::InputOpener open;
+    if (verb == "PATH") {
+        auto input = make_shared<base::InputFile>(payload);
+        open = [input]() { return input->Open(); };
+    } else {
+        open = [&payload]() {
+            return make_unique<base::MemoryIstream>(payload);
+        };
+    }
+    // Every worker keeps its arena between jobs, see base::LinkArena.
+    static thread_local base::LinkArena arena;
+    std::string status = "OK";
+    {
+        ChunkedSocketBuf buf(fd);
+        std::ostream out(&buf);
+        try {
+            linker::LinkOptions link_options;
+            link_options.deadline = deadline;
+            if (!linker::Link(open, out, &arena, link_options)) {
+                stats_.syntax_errors++;
+                status = "SYNTAX_ERROR";
+            }
+        } catch (const tokenizer::LinkTimeout& e) {
+            stats_.timed_out++;
+            status = "TIMEOUT";
+        }
+    }
+    size_t peak = stats_.arena_peak_bytes;
+    while (arena.used() > peak &&
+           !stats_.arena_peak_bytes.compare_exchange_weak(peak, arena.used())) {}
+    arena.Reset();
+    WriteStatus(fd, status);
+    stats_.active--;
+    stats_.completed++;
+    stats_.link_time_us += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Sends one request to a running link server and copies the linker output
+// to stdout. Returns the exit code of the process.
+int RunClient(const std::string& socket_path, const std::string& verb,
+              const std::string& payload) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 ||
+        connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        cerr << "connect " << socket_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    std::string request = verb + " " + std::to_string(payload.length()) + "\n";
+    request += payload;
+    if (!WriteAll(fd, request.data(), request.length())) {
+        cerr << "Failed to send request" << endl;
+        close(fd);
+        return 1;
+    }
+    std::string word;
+    size_t length;
+    std::string chunk;
+    while (true) {
+        // The status frame is "E <status>", read it by hand as the status
+        // isn't a number.
+        std::string line;
+        char c;
+        while (ReadAll(fd, &c, 1) && c != '\n')
+            line.push_back(c);
+        if (line.compare(0, 2, "E ") == 0) {
+            close(fd);
+            std::string status = line.substr(2);
+            if (status == "OK" || status == "SYNTAX_ERROR")
+                return 0;
+            cerr << "Link failed: " << status << endl;
+            return 1;
+        }
+        std::istringstream header(line);
+        if (!(header >> word >> length) || word != "C") {
+            cerr << "Malformed response from server" << endl;
+            close(fd);
+            return 1;
+        }
+        chunk.resize(length);
+        if (!ReadAll(fd, &chunk[0], length)) {
+            cerr << "Connection closed by server" << endl;
+            close(fd);
+            return 1;
+        }
+        cout.write(chunk.data(), length);
+    }
+}
+
+}  // namespace server
+
+void PrintUsage(const char* program) {
+    cerr << "Usage: " << program
+         << " [--arena-stats] [--bench] [--no-warnings | --trusted-input]"
+         << endl
+         << "           [--gc-roots <module>[,<module>...]]"
+         << " [--symbol-index <index>]"
+         << " <object file>... [-l <archive>]..." << endl
+         << "       " << program
+         << " --archive <archive> <object file>..." << endl
+         << "       " << program
+         << " --partial <output> <object file>..." << endl
+         << "       " << program << " --check <object file>..." << endl
+         << "       " << program << " --symbolize <index> <address file>"
+         << endl
+         << "       " << program << " --verify-relocation [iterations]"
+         << endl
+         << "       " << program
+         << " --server <socket> [--jobs N] [--timeout-ms T]" << endl
+         << "       " << program << " --client <socket> <object file>" << endl
+         << "       " << program << " --client <socket> --stats" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    string mode(argv[1]);
+    if (mode == "--server" && argc >= 3) {
+        // Persistent link server. See server::LinkServer.
+        server::ServerOptions options;
+        options.socket_path = argv[2];
+        for (int i = 3; i + 1 < argc; i += 2) {
+            string flag(argv[i]);
+            if (flag == "--jobs") {
+                options.max_jobs = max(1, atoi(argv[i + 1]));
+            } else if (flag == "--timeout-ms") {
+                options.timeout_ms = atoi(argv[i + 1]);
+            } else {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        server::LinkServer link_server(options);
+        return link_server.Run();
+    }
+    if (mode == "--client" && argc >= 4) {
+        string arg(argv[3]);
+        if (arg == "--stats") {
+            return server::RunClient(argv[2], "STATS", "");
+        }
+        // The server may run in another directory, send it an absolute path.
+        unique_ptr<char, decltype(&free)> path(realpath(argv[3], NULL), free);
+        return server::RunClient(argv[2], "PATH", path ? path.get() : arg);
+    }
+
+    if (mode == "--check" && argc >= 3) {
+        // Syntax check only, prints the parse errors a link would.
+        int status = 0;
+        for (int i = 2; i < argc; i++) {
+            string error;
+            try {
+                error = tokenizer::CheckSyntax(base::ReadFile(argv[i]));
+            } catch (const runtime_error& e) {
+                error = e.what();
+            }
+            if (error.empty())
+                continue;
+            if (argc > 3)
+                cout << argv[i] << ": ";
+            cout << error << endl;
+            status = 1;
+        }
+        return status;
+    }
+    if (mode == "--symbolize" && argc == 4) {
+        // Resolves the addresses in a file with the index of a link.
+        try {
+            linker::SymbolIndex index(argv[2]);
+            istringstream addresses(base::ReadFile(argv[3]));
+            string line;
+            int line_number = 0;
+            int bad_lines = 0;
+            int address;
+            // Millions of addresses are expected, don't flush every line.
+            while (getline(addresses, line)) {
+                line_number++;
+                size_t end = line.find_last_not_of(" \t\r");
+                if (end == string::npos)
+                    continue;  // Blank line.
+                line.erase(end + 1);
+                if (!base::TryParseInt(line, &address)) {
+                    cerr << argv[3] << ":" << line_number
+                         << ": not an address: " << line << endl;
+                    bad_lines++;
+                    continue;
+                }
+                cout << address << ": ";
+                if (!index.Symbolize(address, cout))
+                    cout << "not in the program";
+                cout << '\n';
+            }
+            cout.flush();
+            // The other lines are resolved, but the run fails.
+            if (bad_lines > 0)
+                return 1;
+        } catch (const runtime_error& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
         return 0;
     }
+    if (mode == "--verify-relocation") {
+        // Compares the relocation kernel picked for this CPU to the scalar
+        // one under every rule policy.
+        int iterations = argc >= 3 ? atoi(argv[2]) : 10000;
+        bool same =
+            linker::VerifyRelocation<linker::FullChecking>(iterations, cout) &&
+            linker::VerifyRelocation<linker::NoWarnings>(iterations, cout) &&
+            linker::VerifyRelocation<linker::TrustedInput>(iterations, cout);
+        if (same)
+            cout << (base::kCpu.avx2 ? "AVX2" : "Scalar")
+                 << " relocation kernel matches on " << iterations
+                 << " batches per policy" << endl;
+        return same ? 0 : 1;
+    }
+    if (mode == "--partial" && argc >= 4) {
+        vector<string> inputs(argv + 3, argv + argc);
+        return linker::WritePartialLink(argv[2], inputs) ? 0 : 1;
+    }
+    if (mode == "--archive" && argc >= 4) {
+        vector<string> inputs(argv + 3, argv + argc);
+        return archive::WriteArchive(argv[2], inputs) ? 0 : 1;
+    }
 
+    bool arena_stats = false;
+    bool bench = false;
+    vector<string> filenames;
+    vector<unique_ptr<archive::Archive>> archives;
+    vector<int> gc_roots;
+    string symbol_index_file;
+    linker::RuleMode rule_mode = linker::RULES_FULL;
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg == "--arena-stats") {
+            arena_stats = true;
+        } else if (arg == "--bench") {
+            bench = true;
+        } else if (arg == "--no-warnings") {
+            rule_mode = linker::RULES_NO_WARNINGS;
+        } else if (arg == "--trusted-input") {
+            rule_mode = linker::RULES_TRUSTED_INPUT;
+        } else if (arg == "--gc-roots" && i + 1 < argc) {
+            // Module numbers count from 1, as in the messages.
+            istringstream roots(argv[++i]);
+            string root;
+            int module;
+            while (getline(roots, root, ',')) {
+                if (!base::TryParseInt(root, &module) || module < 1) {
+                    cerr << "Error: invalid --gc-roots module: " << root
+                         << endl;
+                    PrintUsage(argv[0]);
+                    return 1;
+                }
+                gc_roots.push_back(module);
+            }
+            if (gc_roots.empty()) {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--symbol-index" && i + 1 < argc) {
+            symbol_index_file = argv[++i];
+        } else if (arg == "-l" && i + 1 < argc) {
+            try {
+                archives.push_back(make_unique<archive::Archive>(argv[++i]));
+            } catch (const runtime_error& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+        } else {
+            filenames.push_back(arg);
+        }
+    }
+    if (filenames.empty()) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    base::LinkArena arena;
+    base::InflateStats inflate_stats;
+    auto input = make_shared<base::InputFile>(filenames[0], &inflate_stats);
+    linker::InputOpener open = [input]() { return input->Open(); };
+    string linked_text;
+    // Object file of every module of linked_text, for warnings.
+    vector<string> module_sources;
+    tokenizer::ConcurrentSymbolTable definitions;
+    vector<int> module_sizes;
+    bool collected_definitions = false;
+    auto start = std::chrono::steady_clock::now();
+    // A single object file is streamed from disk. Otherwise the files are
+    // loaded and parsed in parallel and linked from memory, in command line
+    // order.
+    if (filenames.size() > 1 || !archives.empty() || !gc_roots.empty()) {
+        vector<base::InflateStats> file_stats;
+        auto objects = linker::LoadObjectFiles(filenames, &file_stats);
+        for (const auto& stats : file_stats) {
+            inflate_stats.compressed_bytes += stats.compressed_bytes;
+            inflate_stats.inflated_bytes += stats.inflated_bytes;
+            inflate_stats.inflate_time += stats.inflate_time;
+        }
+        string error;
+        if (gc_roots.empty()) {
+            error = linker::FirstLoadError(objects);
+        } else {
+            // The memory size limit applies to the kept modules only.
+            for (const auto& object : objects) {
+                if (!object.error.empty()) {
+                    error = object.filename + ": " + object.error;
+                    break;
+                }
+            }
+        }
+        if (!error.empty() && filenames.size() > 1) {
+            cout << error << endl;
+            return 0;
+        }
+        // With a single object file the link below reports its errors.
+        if (error.empty()) {
+            for (auto& object : objects) {
+                linked_text += object.text;
+                // Keep the last token of a file off the next file's first.
+                if (!linked_text.empty() && linked_text.back() != '\n')
+                    linked_text += '\n';
+                module_sources.insert(module_sources.end(),
+                                      object.modules.size(), object.filename);
+            }
+            // The parsed modules are the link input, pass 1 needn't read
+            // it again.
+            if (archives.empty() && gc_roots.empty()) {
+                linker::CollectDefinitions(
+                    objects, &definitions, &module_sizes);
+                collected_definitions = true;
+            }
+            // With archives the link input is the object files followed by
+            // the archive modules they need.
+            vector<int> archive_modules;
+            if (!archives.empty()) {
+                try {
+                    linked_text = archive::ResolveArchives(
+                        linked_text, archives, &arena, &module_sources,
+                        &archive_modules);
+                } catch (const runtime_error& e) {
+                    base::PrintError(cerr, e.what());
+                    return 1;
+                }
+            }
+            // Drop the modules unreachable from the roots before addresses
+            // are assigned.
+            if (!gc_roots.empty()) {
+                auto modules = linker::CollectModules(
+                    make_unique<base::MemoryIstream>(linked_text), &arena,
+                    std::numeric_limits<int>::max());
+                // The modules of the object files, as parsed from each
+                // file, then the archive modules with their positions made
+                // relative to the module.
+                vector<const linker::ObjectModule*> originals;
+                vector<string> labels;
+                for (const auto& object : objects) {
+                    for (const auto& module : object.modules) {
+                        originals.push_back(&module);
+                        labels.push_back(
+                            filenames.size() > 1 ? object.filename : "");
+                    }
+                }
+                size_t object_modules = originals.size();
+                for (size_t i = object_modules; i < modules.size(); i++) {
+                    modules[i].instruction_count_line -= modules[i].line - 1;
+                    originals.push_back(&modules[i]);
+                    labels.push_back(module_sources[i] + ": module " +
+                        to_string(archive_modules[i - object_modules]));
+                }
+                vector<int> roots;
+                for (int root : gc_roots) {
+                    if (root > static_cast<int>(object_modules)) {
+                        cerr << "Error: --gc-roots module " << root
+                             << " is out of range, the input has "
+                             << object_modules << " modules" << endl;
+                        return 1;
+                    }
+                    roots.push_back(root - 1);
+                }
+                ostringstream kept_text;
+                vector<const linker::ObjectModule*> kept_modules;
+                vector<string> kept_labels;
+                vector<string> kept_sources;
+                for (int i : linker::ReachableModules(modules, roots)) {
+                    modules[i].Write(kept_text);
+                    kept_modules.push_back(originals[i]);
+                    kept_labels.push_back(labels[i]);
+                    kept_sources.push_back(module_sources[i]);
+                }
+                // The kept modules are checked at their place in the input
+                // as the link below only sees the rewritten text.
+                error = linker::CheckMemorySize(kept_modules, kept_labels);
+                if (!error.empty()) {
+                    cout << error << endl;
+                    return 0;
+                }
+                linked_text = kept_text.str();
+                module_sources = std::move(kept_sources);
+            }
+            open = [&linked_text]() {
+                return make_unique<base::MemoryIstream>(linked_text);
+            };
+        }
+    }
+    linker::LinkOptions link_options;
+    link_options.rule_mode = rule_mode;
+    // Warnings name the object file only when there are several.
+    if (std::find_if(module_sources.begin(), module_sources.end(),
+                     [&](const string& source) {
+                         return source != module_sources.front();
+                     }) != module_sources.end()) {
+        link_options.module_sources = &module_sources;
+    }
+    if (collected_definitions) {
+        link_options.definitions = &definitions;
+        link_options.module_sizes = &module_sizes;
+    }
+    linker::SymbolIndex symbol_index;
+    if (!symbol_index_file.empty())
+        link_options.symbol_index = &symbol_index;
+    bool linked = linker::Link(open, cout, &arena, link_options);
+    if (linked && !symbol_index_file.empty()) {
+        ofstream index_out(symbol_index_file);
+        symbol_index.Write(index_out);
+        if (!index_out) {
+            cerr << "Error: can't write " << symbol_index_file << endl;
+            return 1;
+        }
+    }
+    if (bench) {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        cerr << "Link time: " << elapsed.count() * 1e3 << " ms" << endl;
+        if (inflate_stats.compressed_bytes > 0) {
+            double seconds = std::chrono::duration<double>(
+                inflate_stats.inflate_time).count();
+            cerr << "Inflated: " << inflate_stats.compressed_bytes << " -> "
+                 << inflate_stats.inflated_bytes << " bytes in "
+                 << seconds * 1e3 << " ms ("
+                 << inflate_stats.inflated_bytes / 1e6 / max(seconds, 1e-9)
+                 << " MB/s)" << endl;
+        }
+    }
+    if (arena_stats) {
+        cerr << "Arena peak: " << arena.peak() << " bytes" << endl;
+    }
     return 0;
-}
\ No newline at end of file
+}